@@ -0,0 +1,111 @@
+//
+// Created by fengjiaxin on 2023/5/15.
+// HNSW 索引和精确扫描的对比: 召回率和每次查询的延迟
+
+#include "../src/hnsw.h"
+#include "../src/kernels.h"
+#include "../src/matrix.h"
+#include "../src/rng.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace word2vec;
+
+// 带聚类结构的随机单位向量, 比纯随机数据更接近词向量
+void fill(Matrix& m, XorShiftRng& rng) {
+    int64_t n = m.rows();
+    int64_t dim = m.cols();
+    int64_t clusters = std::max<int64_t>(1, n / 100);
+    std::vector<real> centers(clusters * dim);
+    for (auto& c : centers) {
+        c = rng.uniform() - 0.5;
+    }
+    for (int64_t i = 0; i < n; i++) {
+        const real* center = centers.data() + (rng() % clusters) * dim;
+        real norm = 0;
+        for (int64_t j = 0; j < dim; j++) {
+            m.at(i, j) = center[j] + 0.3 * (rng.uniform() - 0.5);
+            norm += m.at(i, j) * m.at(i, j);
+        }
+        norm = std::sqrt(norm);
+        for (int64_t j = 0; j < dim; j++) {
+            m.at(i, j) /= norm;
+        }
+    }
+}
+
+std::vector<int32_t> exact(const Matrix& m, const real* query, int32_t k) {
+    std::vector<std::pair<real, int32_t>> scores(m.rows());
+    for (int64_t i = 0; i < m.rows(); i++) {
+        scores[i] = std::make_pair(
+                kernels::dot(query, m.data() + i * m.cols(), m.cols()), int32_t(i));
+    }
+    std::partial_sort(
+            scores.begin(),
+            scores.begin() + k,
+            scores.end(),
+            std::greater<std::pair<real, int32_t>>());
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < k; i++) {
+        ids.push_back(scores[i].second);
+    }
+    return ids;
+}
+
+int main(int argc, char** argv) {
+    int64_t n = argc > 1 ? std::stoll(argv[1]) : 100000;
+    int64_t dim = argc > 2 ? std::stoll(argv[2]) : 100;
+    const int32_t k = 10;
+    const int32_t nqueries = 200;
+
+    XorShiftRng rng(1);
+    Matrix m(n, dim);
+    fill(m, rng);
+
+    auto start = std::chrono::steady_clock::now();
+    ThreadPool pool;
+    HnswIndex index(m, 16, 200, std::thread::hardware_concurrency(), pool);
+    double buildSecs = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+    std::cout << "n " << n << " dim " << dim << " build " << std::fixed
+              << std::setprecision(2) << buildSecs << "s" << std::endl;
+
+    std::vector<int32_t> queries;
+    std::vector<std::vector<int32_t>> truth;
+    start = std::chrono::steady_clock::now();
+    for (int32_t q = 0; q < nqueries; q++) {
+        queries.push_back(rng() % n);
+        truth.push_back(exact(m, m.data() + queries.back() * dim, k));
+    }
+    double exactUs = std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - start).count() / nqueries;
+    std::cout << std::setw(8) << "exact" << std::setw(10) << "1.000"
+              << std::setw(12) << exactUs << " us/query" << std::endl;
+
+    for (int32_t ef : {10, 16, 32, 64, 128, 256}) {
+        int64_t hits = 0;
+        start = std::chrono::steady_clock::now();
+        for (int32_t q = 0; q < nqueries; q++) {
+            auto found = index.search(m.data() + queries[q] * dim, k, ef);
+            std::set<int32_t> expected(truth[q].begin(), truth[q].end());
+            for (const auto& item : found) {
+                hits += expected.count(item.second);
+            }
+        }
+        double us = std::chrono::duration<double, std::micro>(
+                std::chrono::steady_clock::now() - start).count() / nqueries;
+        std::cout << std::setw(5) << "ef=" << std::setw(3) << ef << std::setw(10)
+                  << std::setprecision(3) << double(hits) / (k * nqueries)
+                  << std::setw(12) << std::setprecision(2) << us << " us/query"
+                  << std::endl;
+    }
+    return 0;
+}
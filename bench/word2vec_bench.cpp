@@ -0,0 +1,326 @@
+//
+// Created by fengjiaxin on 2023/5/18.
+// 训练吞吐和热点函数的基准测试, 在本地生成 Zipf 分布的语料, 结果输出为 JSON
+//
+// usage: word2vec_bench [-tokens N] [-vocab N] [-maxThread N] [-output file.json]
+// 训练的 numa 对比: 同样的 sg 配置分别用 -numa none/interleave/partition 跑线程数扫描
+
+#include "../src/alias_sample.h"
+#include "../src/args.h"
+#include "../src/dictionary.h"
+#include "../src/kernels.h"
+#include "../src/numa.h"
+#include "../src/rng.h"
+#include "../src/word2vec.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace word2vec;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds(const Clock::time_point& start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// 每个结果是一行 JSON 对象, 最后拼成数组
+class Report {
+private:
+    std::vector<std::string> rows_;
+    std::ostringstream row_;
+
+public:
+    Report& begin(const std::string& name) {
+        row_.str("");
+        row_ << "{\"name\": \"" << name << "\"";
+        return *this;
+    }
+
+    template <typename T>
+    Report& add(const std::string& key, const T& value) {
+        row_ << ", \"" << key << "\": " << value;
+        return *this;
+    }
+
+    Report& add(const std::string& key, const std::string& value) {
+        row_ << ", \"" << key << "\": \"" << value << "\"";
+        return *this;
+    }
+
+    void end() {
+        row_ << "}";
+        rows_.push_back(row_.str());
+        std::cerr << row_.str() << std::endl;
+    }
+
+    void write(std::ostream& out) const {
+        out << "{\"kernel\": \"" << kernels::active().name << "\", "
+            << "\"hardware_concurrency\": " << std::thread::hardware_concurrency()
+            << ", \"numa_nodes\": " << NumaTopology::detect().nodes()
+            << ", \"results\": [\n";
+        for (size_t i = 0; i < rows_.size(); i++) {
+            out << "  " << rows_[i] << (i + 1 < rows_.size() ? ",\n" : "\n");
+        }
+        out << "]}" << std::endl;
+    }
+};
+
+std::vector<int32_t> zipfCounts(int32_t vocab, int64_t tokens) {
+    double norm = 0;
+    for (int32_t i = 0; i < vocab; i++) {
+        norm += 1.0 / (i + 1);
+    }
+    std::vector<int32_t> counts(vocab);
+    for (int32_t i = 0; i < vocab; i++) {
+        counts[i] = std::max<int64_t>(1, int64_t(tokens / norm / (i + 1)));
+    }
+    return counts;
+}
+
+void generateCorpus(const std::string& filename, int32_t vocab, int64_t tokens) {
+    std::vector<int32_t> counts = zipfCounts(vocab, tokens);
+    std::vector<double> cumulative(vocab);
+    double sum = 0;
+    for (int32_t i = 0; i < vocab; i++) {
+        sum += counts[i];
+        cumulative[i] = sum;
+    }
+    XorShiftRng rng(1);
+    std::ofstream ofs(filename);
+    int64_t written = 0;
+    while (written < tokens) {
+        int32_t length = 10 + rng() % 21;
+        for (int32_t j = 0; j < length; j++) {
+            double u = rng.uniform() * sum;
+            int32_t w = std::lower_bound(cumulative.begin(), cumulative.end(), u) -
+                    cumulative.begin();
+            ofs << (j > 0 ? " " : "") << "w" << std::min(w, vocab - 1);
+        }
+        ofs << "\n";
+        written += length;
+    }
+}
+
+void benchTrain(
+        Report& report,
+        const std::string& input,
+        model_name model,
+        int32_t dim,
+        int32_t neg,
+        int32_t ws,
+        int32_t thread,
+        numa_mode numa = numa_mode::none) {
+    Args args;
+    args.input = input;
+    args.output = "unused";
+    args.model = model;
+    args.dim = dim;
+    args.neg = neg;
+    args.ws = ws;
+    args.thread = thread;
+    args.numa = numa;
+    args.epoch = 1;
+    args.minCount = 1;
+    args.verbose = 0;
+
+    Word2Vec word2Vec;
+    auto start = Clock::now();
+    word2Vec.train(args);
+    double total = seconds(start);
+    // 吞吐只用训练阶段的时间, 读词典和初始化矩阵单独列出
+    double secs = word2Vec.getTrainSeconds();
+    int64_t tokens = word2Vec.getDictionary()->ntokens() * args.epoch;
+    report.begin("train")
+            .add("model", std::string(model == model_name::sg ? "sg" : "cbow"))
+            .add("dim", dim)
+            .add("neg", neg)
+            .add("ws", ws)
+            .add("thread", thread)
+            .add("numa", args.numaToString(numa))
+            .add("seconds", secs)
+            .add("setup_seconds", total - secs)
+            .add("words_per_sec_per_thread", tokens / secs / thread)
+            .end();
+}
+
+void benchAlias(Report& report, int32_t vocab, int32_t maxThread) {
+    std::vector<int32_t> counts = zipfCounts(vocab, 100000000);
+    std::vector<int32_t> ids(vocab);
+    for (int32_t i = 0; i < vocab; i++) {
+        ids[i] = i;
+    }
+    const AliasSample alias(counts, ids);
+    const int64_t samples = 10000000;
+    for (int32_t thread = 1; thread <= maxThread; thread *= 2) {
+        std::vector<int64_t> sinks(thread, 0);
+        std::vector<std::thread> threads;
+        auto start = Clock::now();
+        for (int32_t t = 0; t < thread; t++) {
+            threads.emplace_back([&, t]() {
+                XorShiftRng rng(t);
+                int64_t sink = 0;
+                for (int64_t i = 0; i < samples; i++) {
+                    sink += alias.Next(rng);
+                }
+                sinks[t] = sink;
+            });
+        }
+        for (auto& item : threads) {
+            item.join();
+        }
+        double secs = seconds(start);
+        report.begin("alias_sample_next")
+                .add("thread", thread)
+                .add("ns_per_op", secs * 1e9 / samples)
+                .add("samples_per_sec", samples * thread / secs)
+                .end();
+    }
+}
+
+void benchGetLine(Report& report, const std::string& input) {
+    auto args = std::make_shared<Args>();
+    args->minCount = 1;
+    args->verbose = 0;
+    Dictionary dict(args);
+    ThreadPool pool;
+    dict.readFromFile(input, 1, pool);
+
+    std::ifstream ifs(input);
+    std::vector<int32_t> line;
+    XorShiftRng rng(0);
+    int64_t tokens = 0;
+    auto start = Clock::now();
+    while (!ifs.eof()) {
+        tokens += dict.getLine(ifs, line, rng);
+    }
+    double secs = seconds(start);
+    report.begin("dictionary_get_line")
+            .add("tokens", tokens)
+            .add("tokens_per_sec", tokens / secs)
+            .end();
+}
+
+template <typename F>
+double nsPerOp(F f, int64_t iters) {
+    auto start = Clock::now();
+    for (int64_t i = 0; i < iters; i++) {
+        f(i);
+    }
+    return seconds(start) * 1e9 / iters;
+}
+
+// 当前 CPU 支持的每种实现都跑一遍, 对比标量/SSE/AVX2/AVX-512
+void benchKernels(Report& report) {
+    const int64_t rows = 1024; // 多行轮流访问, 结果不会被编译器整体优化掉
+    const int64_t iters = 1000000;
+    for (const auto& table : kernels::available()) {
+        for (int64_t dim : {32, 100, 128, 300, 512}) {
+            std::vector<real> m(rows * dim, 0.01);
+            std::vector<real> v(dim, 0.5);
+            std::vector<real> g(dim, 0);
+            std::vector<uint16_t> half(dim, 0);
+            volatile real sink = 0;
+
+            double dot = nsPerOp([&](int64_t i) {
+                sink += table.dot(m.data() + (i % rows) * dim, v.data(), dim);
+            }, iters);
+            double axpy = nsPerOp([&](int64_t i) {
+                table.axpy(1e-6, v.data(), m.data() + (i % rows) * dim, dim);
+            }, iters);
+            double add = nsPerOp([&](int64_t i) {
+                table.add(m.data() + (i % rows) * dim, g.data(), dim);
+            }, iters);
+            double update = nsPerOp([&](int64_t i) {
+                table.update(1e-6, v.data(), m.data() + (i % rows) * dim, g.data(), dim);
+            }, iters);
+            double toFp16 = nsPerOp([&](int64_t i) {
+                table.floatToFp16(m.data() + (i % rows) * dim, half.data(), dim);
+            }, iters);
+            double fromFp16 = nsPerOp([&](int64_t i) {
+                table.fp16ToFloat(half.data(), m.data() + (i % rows) * dim, dim);
+            }, iters);
+            report.begin("matrix_kernels")
+                    .add("kernel", std::string(table.name))
+                    .add("dim", dim)
+                    .add("dot_ns", dot)
+                    .add("axpy_ns", axpy)
+                    .add("add_ns", add)
+                    .add("update_ns", update)
+                    .add("float_to_fp16_ns", toFp16)
+                    .add("fp16_to_float_ns", fromFp16)
+                    .end();
+        }
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    int64_t tokens = 2000000;
+    int32_t vocab = 30000;
+    int32_t maxThread = std::max<int32_t>(1, std::thread::hardware_concurrency());
+    std::string output;
+    for (int ai = 1; ai + 1 < argc; ai += 2) {
+        std::string arg(argv[ai]);
+        if (arg == "-tokens") {
+            tokens = std::stoll(argv[ai + 1]);
+        } else if (arg == "-vocab") {
+            vocab = std::stoi(argv[ai + 1]);
+        } else if (arg == "-maxThread") {
+            maxThread = std::stoi(argv[ai + 1]);
+        } else if (arg == "-output") {
+            output = argv[ai + 1];
+        } else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    const std::string corpus = "word2vec_bench_corpus.txt";
+    generateCorpus(corpus, vocab, tokens);
+
+    Report report;
+    benchKernels(report);
+    benchAlias(report, vocab, maxThread);
+    benchGetLine(report, corpus);
+    for (model_name model : {model_name::sg, model_name::cbow}) {
+        for (int32_t dim : {50, 100, 300}) {
+            benchTrain(report, corpus, model, dim, 5, 5, 1);
+        }
+        for (int32_t neg : {2, 10}) {
+            benchTrain(report, corpus, model, 100, neg, 5, 1);
+        }
+        for (int32_t ws : {2, 10}) {
+            benchTrain(report, corpus, model, 100, 5, ws, 1);
+        }
+        for (int32_t thread = 2; thread <= maxThread; thread *= 2) {
+            benchTrain(report, corpus, model, 100, 5, 5, thread);
+        }
+    }
+    // 多路服务器上看 words/sec 随线程数跨过 socket 之后的变化
+    for (numa_mode numa : {numa_mode::interleave, numa_mode::partition}) {
+        for (int32_t thread = 1; thread <= maxThread; thread *= 2) {
+            benchTrain(report, corpus, model_name::sg, 100, 5, 5, thread, numa);
+        }
+    }
+    std::remove(corpus.c_str());
+
+    if (output.empty()) {
+        report.write(std::cout);
+    } else {
+        std::ofstream ofs(output);
+        report.write(ofs);
+    }
+    return 0;
+}
@@ -6,11 +6,12 @@
 #define WORD2VEC_ALIAS_SAMPLE_H
 
 
+#include <cassert>
+#include <cmath>
 #include <deque>
 #include <vector>
-#include <unordered_map>
-#include <random>
-#include <ctime>
+
+#include "rng.h"
 
 // https://www.cnblogs.com/Lee-yl/p/12749070.html
 namespace word2vec {
@@ -20,18 +21,12 @@ private:
     std::vector<float> probability;
     std::vector<int32_t> alias;
     std::vector<int32_t> ids;
-
-    std::uniform_real_distribution<float> rnd_;
-    std::uniform_int_distribution<int32_t> rnd_idx_;
-
-    std::default_random_engine rnd {static_cast<uint_fast32_t>(time(nullptr))};
     int32_t len;
 
 public:
     // id是已经对word进行编码
     explicit AliasSample(const std::vector<int32_t> &freqs, const std::vector<int32_t> &ids_) :
-            probability(freqs.size(), 0), alias(freqs.size(), 0), ids(ids_),
-            rnd_(0.0, 1.0), rnd_idx_(0, freqs.size() - 1) {
+            probability(freqs.size(), 0), alias(freqs.size(), 0), ids(ids_) {
         assert(freqs.size() == ids_.size());
 
         len = freqs.size();
@@ -86,9 +81,11 @@ public:
         }
     }
 
-    int32_t Next() {
-        float d = rnd_(rnd);
-        int32_t column = rnd_idx_(rnd);
+    // 采样表只读, 随机状态由调用方(每个训练线程)持有, 多线程之间不共享可变状态
+    int32_t Next(XorShiftRng& rng) const {
+        uint64_t r = rng();
+        int32_t column = int32_t(((r >> 32) * uint64_t(len)) >> 32);
+        float d = float(uint32_t(r) >> 8) * (1.0f / 16777216.0f);
 
         if (d < probability[column]) {
             return ids[column];
@@ -17,23 +17,62 @@ Args::Args() {
     epoch = 5;
     minCount = 5;
     neg = 5;
+    t = 1e-4;
     loss = loss_name::ns;
+    dtype = dtype_name::fp32;
     model = model_name::sg;
     thread = 12;
     lrUpdateRate = 100;
     verbose = 2;
     saveOutput = false;
+    saveNormalized = false;
     seed = 0;
+    metricsInterval = 5;
+    dsub = 2;
+    checkpoint = 0;
+    resume = false;
+    streamTokens = 0;
+    world = 1;
+    rank = 0;
+    master = "127.0.0.1:7711";
+    syncInterval = 2;
+    numa = numa_mode::none;
 }
 
 std::string Args::lossToString(loss_name ln) const {
     switch (ln) {
         case loss_name::ns:
             return "ns";
+        case loss_name::hs:
+            return "hs";
     }
     return "Unknown loss!"; // should never happen
 }
 
+std::string Args::dtypeToString(dtype_name dn) const {
+    switch (dn) {
+        case dtype_name::fp32:
+            return "fp32";
+        case dtype_name::fp16:
+            return "fp16";
+        case dtype_name::bf16:
+            return "bf16";
+    }
+    return "Unknown dtype!"; // should never happen
+}
+
+std::string Args::numaToString(numa_mode nm) const {
+    switch (nm) {
+        case numa_mode::none:
+            return "none";
+        case numa_mode::interleave:
+            return "interleave";
+        case numa_mode::partition:
+            return "partition";
+    }
+    return "Unknown numa mode!"; // should never happen
+}
+
 std::string Args::boolToString(bool b) const {
     if (b) {
         return "true";
@@ -76,6 +115,20 @@ void Args::parseArgs(const std::vector<std::string>& args) {
                 input = std::string(args.at(ai + 1));
             } else if (args[ai] == "-output") {
                 output = std::string(args.at(ai + 1));
+            } else if (args[ai] == "-vocab") {
+                vocab = std::string(args.at(ai + 1));
+            } else if (args[ai] == "-streamTokens") {
+                streamTokens = std::stoll(args.at(ai + 1));
+            } else if (args[ai] == "-world") {
+                world = std::stoi(args.at(ai + 1));
+            } else if (args[ai] == "-rank") {
+                rank = std::stoi(args.at(ai + 1));
+            } else if (args[ai] == "-master") {
+                master = std::string(args.at(ai + 1));
+            } else if (args[ai] == "-syncInterval") {
+                syncInterval = std::stoi(args.at(ai + 1));
+            } else if (args[ai] == "-pretrained") {
+                pretrained = std::string(args.at(ai + 1));
             } else if (args[ai] == "-lr") {
                 lr = std::stof(args.at(ai + 1));
             } else if (args[ai] == "-lrUpdateRate") {
@@ -90,14 +143,42 @@ void Args::parseArgs(const std::vector<std::string>& args) {
                 minCount = std::stoi(args.at(ai + 1));
             } else if (args[ai] == "-neg") {
                 neg = std::stoi(args.at(ai + 1));
+            } else if (args[ai] == "-t") {
+                t = std::stof(args.at(ai + 1));
             } else if (args[ai] == "-loss") {
                 if (args.at(ai + 1) == "ns") {
                     loss = loss_name::ns;
+                } else if (args.at(ai + 1) == "hs") {
+                    loss = loss_name::hs;
                 } else {
                     std::cerr << "Unknown loss: " << args.at(ai + 1) << std::endl;
                     printHelp();
                     exit(EXIT_FAILURE);
                 }
+            } else if (args[ai] == "-dtype") {
+                if (args.at(ai + 1) == "fp32") {
+                    dtype = dtype_name::fp32;
+                } else if (args.at(ai + 1) == "fp16") {
+                    dtype = dtype_name::fp16;
+                } else if (args.at(ai + 1) == "bf16") {
+                    dtype = dtype_name::bf16;
+                } else {
+                    std::cerr << "Unknown dtype: " << args.at(ai + 1) << std::endl;
+                    printHelp();
+                    exit(EXIT_FAILURE);
+                }
+            } else if (args[ai] == "-numa") {
+                if (args.at(ai + 1) == "none") {
+                    numa = numa_mode::none;
+                } else if (args.at(ai + 1) == "interleave") {
+                    numa = numa_mode::interleave;
+                } else if (args.at(ai + 1) == "partition") {
+                    numa = numa_mode::partition;
+                } else {
+                    std::cerr << "Unknown numa mode: " << args.at(ai + 1) << std::endl;
+                    printHelp();
+                    exit(EXIT_FAILURE);
+                }
             } else if (args[ai] == "-thread") {
                 thread = std::stoi(args.at(ai + 1));
             } else if (args[ai] == "-verbose") {
@@ -105,8 +186,22 @@ void Args::parseArgs(const std::vector<std::string>& args) {
             } else if (args[ai] == "-saveOutput") {
                 saveOutput = true;
                 ai--;
+            } else if (args[ai] == "-saveNormalized") {
+                saveNormalized = true;
+                ai--;
             } else if (args[ai] == "-seed") {
                 seed = std::stoi(args.at(ai + 1));
+            } else if (args[ai] == "-checkpoint") {
+                checkpoint = std::stoi(args.at(ai + 1));
+            } else if (args[ai] == "-resume") {
+                resume = true;
+                ai--;
+            } else if (args[ai] == "-dsub") {
+                dsub = std::stoi(args.at(ai + 1));
+            } else if (args[ai] == "-metrics") {
+                metrics = std::string(args.at(ai + 1));
+            } else if (args[ai] == "-metricsInterval") {
+                metricsInterval = std::stoi(args.at(ai + 1));
             } else {
                 std::cerr << "Unknown argument: " << args[ai] << std::endl;
                 printHelp();
@@ -123,12 +218,18 @@ void Args::parseArgs(const std::vector<std::string>& args) {
         printHelp();
         exit(EXIT_FAILURE);
     }
+    if (world < 1 || rank < 0 || rank >= world) {
+        std::cerr << "-rank should be in [0, -world)." << std::endl;
+        printHelp();
+        exit(EXIT_FAILURE);
+    }
 }
 
 void Args::printHelp() {
     printBasicHelp();
     printDictionaryHelp();
     printTrainingHelp();
+    printQuantizationHelp();
 }
 
 void Args::printBasicHelp() {
@@ -142,7 +243,9 @@ void Args::printBasicHelp() {
 void Args::printDictionaryHelp() {
     std::cerr << "\nThe following arguments for the dictionary are optional:\n"
               << "  -minCount           minimal number of word occurences ["
-              << minCount << "]\n";
+              << minCount << "]\n"
+              << "  -t                  sampling threshold, 0 to disable [" << t << "]\n"
+              << "  -vocab              use the vocabulary of a model or encoded corpus, required for stdin []\n";
 }
 
 void Args::printTrainingHelp() {
@@ -156,16 +259,43 @@ void Args::printTrainingHelp() {
             << "  -ws                 size of the context window [" << ws << "]\n"
             << "  -epoch              number of epochs [" << epoch << "]\n"
             << "  -neg                number of negatives sampled [" << neg << "]\n"
-            << "  -loss               loss function {ns, hs, softmax, one-vs-all} ["
+            << "  -loss               loss function {ns, hs} ["
             << lossToString(loss) << "]\n"
+            << "  -dtype              storage precision of the matrices {fp32, fp16, bf16} ["
+            << dtypeToString(dtype) << "]\n"
             << "  -thread             number of threads (set to 1 to ensure "
                "reproducible results) ["
             << thread << "]\n"
+            << "  -numa               pin threads to nodes and place the matrices {none, interleave, partition} ["
+            << numaToString(numa) << "]\n"
             << "  -saveOutput         whether output params should be saved ["
             << boolToString(saveOutput) << "]\n"
-            << "  -seed               random generator seed  [" << seed << "]\n";
+            << "  -saveNormalized     whether normalized word vectors should be stored in the model ["
+            << boolToString(saveNormalized) << "]\n"
+            << "  -seed               random generator seed  [" << seed << "]\n"
+            << "  -pretrained         continue training a saved model on the new input, adding new words []\n"
+            << "  -streamTokens       expected number of words when training from stdin or a pipe, 0 to use the vocabulary counts ["
+            << streamTokens << "]\n"
+            << "  -checkpoint         seconds between two checkpoints saved to <output>.ckpt, 0 to disable ["
+            << checkpoint << "]\n"
+            << "  -resume             continue training from <output>.ckpt ["
+            << boolToString(resume) << "]\n"
+            << "  -world              number of processes training together [" << world << "]\n"
+            << "  -rank               rank of this process, rank 0 collects updates and saves the model ["
+            << rank << "]\n"
+            << "  -master             address of rank 0, host:port or unix:path [" << master << "]\n"
+            << "  -syncInterval       seconds between two parameter synchronizations ["
+            << syncInterval << "]\n"
+            << "  -metrics            write training metrics as json lines to this file []\n"
+            << "  -metricsInterval    seconds between two metrics records ["
+            << metricsInterval << "]\n";
 }
 
+void Args::printQuantizationHelp() {
+    std::cerr
+            << "\nThe following arguments for quantization are optional:\n"
+            << "  -dsub               size of each sub-vector [" << dsub << "]\n";
+}
 
 void Args::save(std::ostream& out) {
     out.write((char*)&(dim), sizeof(int));
@@ -176,6 +306,8 @@ void Args::save(std::ostream& out) {
     out.write((char*)&(loss), sizeof(loss_name));
     out.write((char*)&(model), sizeof(model_name));
     out.write((char*)&(lrUpdateRate), sizeof(int));
+    out.write((char*)&(t), sizeof(double));
+    out.write((char*)&(dtype), sizeof(dtype_name));
 }
 
 void Args::load(std::istream& in) {
@@ -187,6 +319,21 @@ void Args::load(std::istream& in) {
     in.read((char*)&(loss), sizeof(loss_name));
     in.read((char*)&(model), sizeof(model_name));
     in.read((char*)&(lrUpdateRate), sizeof(int));
+    in.read((char*)&(t), sizeof(double));
+    in.read((char*)&(dtype), sizeof(dtype_name));
+}
+
+void Args::loadLegacy(std::istream& in) {
+    in.read((char*)&(dim), sizeof(int));
+    in.read((char*)&(ws), sizeof(int));
+    in.read((char*)&(epoch), sizeof(int));
+    in.read((char*)&(minCount), sizeof(int));
+    in.read((char*)&(neg), sizeof(int));
+    in.read((char*)&(loss), sizeof(loss_name));
+    in.read((char*)&(model), sizeof(model_name));
+    in.read((char*)&(lrUpdateRate), sizeof(int));
+    // 旧格式没有存精度, 矩阵都是 fp32
+    dtype = dtype_name::fp32;
 }
 
 void Args::dump(std::ostream& out) const {
@@ -206,6 +353,10 @@ void Args::dump(std::ostream& out) const {
         << " " << modelToString(model) << std::endl;
     out << "lrUpdateRate"
         << " " << lrUpdateRate << std::endl;
+    out << "t"
+        << " " << t << std::endl;
+    out << "dtype"
+        << " " << dtypeToString(dtype) << std::endl;
 }
 
 
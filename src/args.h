@@ -11,10 +11,13 @@
 #include <string>
 #include <vector>
 
+#include "real.h"
+
 namespace word2vec {
 
 enum class model_name : int { cbow = 1, sg };
-enum class loss_name : int { ns = 1};
+enum class loss_name : int { ns = 1, hs };
+enum class numa_mode : int { none = 1, interleave, partition };
 
 class Args {
 protected:
@@ -25,6 +28,8 @@ public:
     Args();
     std::string input;
     std::string output;
+    std::string pretrained;
+    std::string vocab;
     double lr;
     int lrUpdateRate;
     int dim;
@@ -32,22 +37,41 @@ public:
     int epoch;
     int minCount;
     int neg;
+    double t;
     loss_name loss;
+    dtype_name dtype;
     model_name model;
     int thread;
     int verbose;
     bool saveOutput;
+    bool saveNormalized;
     int seed;
+    std::string metrics;
+    int metricsInterval;
+    int dsub;
+    int checkpoint;
+    bool resume;
+    int64_t streamTokens;
+    int world;
+    int rank;
+    std::string master;
+    int syncInterval;
+    numa_mode numa;
 
     void parseArgs(const std::vector<std::string>& args);
     void printHelp();
     void printBasicHelp();
     void printDictionaryHelp();
     void printTrainingHelp();
+    void printQuantizationHelp();
     void save(std::ostream&);
     void load(std::istream&);
+    // 旧格式(magic 793712314)的模型只存了前 8 个参数
+    void loadLegacy(std::istream&);
     void dump(std::ostream&) const;
     std::string lossToString(loss_name) const;
+    std::string dtypeToString(dtype_name) const;
+    std::string numaToString(numa_mode) const;
 };
 
 } // namespace word2vec
@@ -0,0 +1,107 @@
+//
+// Created by fengjiaxin on 2023/5/12.
+//
+
+#include "corpus.h"
+
+#include "utils.h"
+
+#include <sys/mman.h>
+
+#include <cassert>
+#include <fstream>
+#include <stdexcept>
+
+namespace word2vec {
+
+Corpus::Corpus(std::shared_ptr<Args> args, const std::string& filename)
+        : ids_(nullptr), size_(0) {
+    std::ifstream ifs(filename, std::ifstream::binary);
+    if (!ifs.is_open()) {
+        throw std::invalid_argument(filename + " cannot be opened for training!");
+    }
+    int32_t magic;
+    int32_t version;
+    int64_t offset;
+    ifs.read((char*)&magic, sizeof(int32_t));
+    ifs.read((char*)&version, sizeof(int32_t));
+    ifs.read((char*)&size_, sizeof(int64_t));
+    ifs.read((char*)&offset, sizeof(int64_t));
+    if (!ifs || magic != CORPUS_MAGIC_INT32 || version != CORPUS_VERSION) {
+        throw std::invalid_argument(filename + " has wrong corpus format!");
+    }
+    dict_ = std::make_shared<Dictionary>(args, ifs);
+    ifs.close();
+
+    int64_t length;
+    mapping_ = utils::mapFile(filename, length, false);
+    if (offset + size_ * int64_t(sizeof(int32_t)) > length) {
+        throw std::invalid_argument(filename + " is truncated!");
+    }
+    madvise(mapping_.get(), length, MADV_SEQUENTIAL);
+    ids_ = reinterpret_cast<const int32_t*>((const char*)mapping_.get() + offset);
+}
+
+bool Corpus::isEncoded(const std::string& filename) {
+    std::ifstream ifs(filename, std::ifstream::binary);
+    int32_t magic = 0;
+    ifs.read((char*)&magic, sizeof(int32_t));
+    return ifs && magic == CORPUS_MAGIC_INT32;
+}
+
+void Corpus::encode(
+        const Dictionary& dict,
+        std::istream& in,
+        const std::string& filename) {
+    std::ofstream ofs(filename, std::ofstream::binary);
+    if (!ofs.is_open()) {
+        throw std::invalid_argument(filename + " cannot be opened for saving!");
+    }
+    const int32_t magic = CORPUS_MAGIC_INT32;
+    const int32_t version = CORPUS_VERSION;
+    int64_t size = 0;
+    int64_t offset = 0;
+    ofs.write((char*)&magic, sizeof(int32_t));
+    ofs.write((char*)&version, sizeof(int32_t));
+    ofs.write((char*)&size, sizeof(int64_t));
+    ofs.write((char*)&offset, sizeof(int64_t));
+    dict.save(ofs);
+
+    offset = utils::pad(ofs, ALIGNMENT);
+    size = dict.encode(in, ofs);
+
+    ofs.seekp(2 * sizeof(int32_t));
+    ofs.write((char*)&size, sizeof(int64_t));
+    ofs.write((char*)&offset, sizeof(int64_t));
+    ofs.close();
+    if (!ofs) {
+        throw std::runtime_error(filename + " cannot be written!");
+    }
+}
+
+std::shared_ptr<Dictionary> Corpus::getDictionary() const {
+    return dict_;
+}
+
+void Corpus::shard(
+        int32_t threadId,
+        int32_t thread,
+        int64_t& begin,
+        int64_t& end) const {
+    begin = threadId * size_ / thread;
+    end = (threadId + 1) * size_ / thread;
+}
+
+int32_t Corpus::getLine(
+        int64_t& pos,
+        int64_t begin,
+        int64_t end,
+        std::vector<int32_t>& words,
+        XorShiftRng& rng) const {
+    if (pos >= end) { // 和 Dictionary::reset 一样, 读完自己的分片后从头开始
+        pos = begin;
+    }
+    return dict_->getLine(ids_, pos, end, words, rng);
+}
+
+} // namespace word2vec
@@ -0,0 +1,63 @@
+//
+// Created by fengjiaxin on 2023/5/12.
+// 预先编码好的二进制语料, 训练时 mmap 只读映射, 不再做分词和 hash
+
+#ifndef WORD2VEC_CORPUS_H
+#define WORD2VEC_CORPUS_H
+
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "args.h"
+#include "dictionary.h"
+#include "rng.h"
+
+namespace word2vec {
+
+// 文件格式:
+// int32 magic | int32 version | int64 id 个数 | int64 id 数组的偏移
+// Dictionary::save 的内容
+// 补齐到 64 字节
+// int32 id 数组, Dictionary::EOS 表示句子结束
+class Corpus {
+private:
+    static const int32_t CORPUS_MAGIC_INT32 = 793712315;
+    static const int32_t CORPUS_VERSION = 1;
+    static const int64_t ALIGNMENT = 64;
+
+    std::shared_ptr<Dictionary> dict_;
+    std::shared_ptr<void> mapping_;
+    const int32_t* ids_;
+    int64_t size_;
+
+public:
+    Corpus(std::shared_ptr<Args>, const std::string&);
+
+    static bool isEncoded(const std::string&);
+    static void encode(const Dictionary&, std::istream&, const std::string&);
+
+    std::shared_ptr<Dictionary> getDictionary() const;
+
+    inline int64_t size() const {
+        return size_;
+    }
+
+    inline const int32_t* data() const {
+        return ids_;
+    }
+
+    // 按 id 的偏移给线程划分语料, 而不是在文本的字节位置上 seek
+    void shard(int32_t threadId, int32_t thread, int64_t& begin, int64_t& end) const;
+    int32_t getLine(
+            int64_t& pos,
+            int64_t begin,
+            int64_t end,
+            std::vector<int32_t>& words,
+            XorShiftRng& rng) const;
+};
+
+} // namespace word2vec
+
+#endif //WORD2VEC_CORPUS_H
@@ -4,24 +4,32 @@
 
 
 #include "dictionary.h"
+#include "utils.h"
 #include <assert.h>
 #include <algorithm>
+#include <atomic>
+#include <climits>
 #include <cmath>
 #include <fstream>
 #include <iostream>
 #include <iterator>
 #include <stdexcept>
+#include <unordered_map>
 
 namespace word2vec {
 
+const int32_t Dictionary::MAX_LINE_SIZE;
+const int32_t Dictionary::EOS;
+
 Dictionary::Dictionary(std::shared_ptr<Args> args)
         : args_(args),
-          word2int_(MAX_VOCAB_SIZE, -1),
+          table_(MIN_TABLE_SIZE, slot{0, -1}),
           nwords_(0),
           ntokens_(0) {}
 
 Dictionary::Dictionary(std::shared_ptr<Args> args, std::istream& in)
         : args_(args),
+          table_(MIN_TABLE_SIZE, slot{0, -1}),
           nwords_(0),
           ntokens_(0) {
     load(in);
@@ -32,25 +40,61 @@ int32_t Dictionary::find(const std::string& w) const {
 }
 
 int32_t Dictionary::find(const std::string& w, uint32_t h) const {
-    int32_t word2intsize = word2int_.size();
-    int32_t id = h % word2intsize;
-    while (word2int_[id] != -1 && words_[word2int_[id]].word != w) {
-        id = (id + 1) % word2intsize;
+    const size_t mask = table_.size() - 1;
+    size_t id = h & mask;
+    while (table_[id].id != -1 &&
+           (table_[id].hash != h || !equals(table_[id].id, w))) {
+        id = (id + 1) & mask;
     }
     return id;
 }
 
+bool Dictionary::equals(int32_t id, const std::string& w) const {
+    const entry& e = words_[id];
+    return e.size == w.size() &&
+            std::equal(w.begin(), w.end(), arena_.begin() + e.offset);
+}
+
+// 把词追加到 arena_ 和 words_, 不修改 hash 表
+int32_t Dictionary::push(const std::string& w, uint32_t h, int32_t count) {
+    entry e;
+    e.offset = arena_.size();
+    e.size = w.size();
+    e.count = count;
+    e.hash = h;
+    arena_.insert(arena_.end(), w.begin(), w.end());
+    words_.push_back(e);
+    return nwords_++;
+}
+
+// 用缓存的 hash 重建表, 不需要重新计算 hash 和比较字符串
+void Dictionary::rehash(int64_t capacity) {
+    int64_t size = MIN_TABLE_SIZE;
+    while (size < capacity) {
+        size *= 2;
+    }
+    table_.assign(size, slot{0, -1});
+    const size_t mask = size - 1;
+    for (int32_t i = 0; i < nwords_; i++) {
+        size_t id = words_[i].hash & mask;
+        while (table_[id].id != -1) {
+            id = (id + 1) & mask;
+        }
+        table_[id] = slot{words_[i].hash, i};
+    }
+}
+
 void Dictionary::add(const std::string& w) {
-    int32_t h = find(w);
+    uint32_t h = hash(w);
+    int32_t id = find(w, h);
     ntokens_++;
-    if (word2int_[h] == -1) {
-        entry e;
-        e.word = w;
-        e.count = 1;
-        words_.push_back(e);
-        word2int_[h] = nwords_++;
+    if (table_[id].id == -1) {
+        table_[id] = slot{h, push(w, h, 1)};
+        if (nwords_ > 0.7 * table_.size()) {
+            rehash(2 * table_.size());
+        }
     } else {
-        words_[word2int_[h]].count++;
+        words_[table_[id].id].count++;
     }
 }
 
@@ -66,14 +110,14 @@ int64_t Dictionary::ntokens() const {
 // 如果找不到 return -1
 int32_t Dictionary::getId(const std::string& w) const {
     int32_t h = find(w);
-    return word2int_[h];
+    return table_[h].id;
 }
 
 
 std::string Dictionary::getWord(int32_t id) const {
     assert(id >= 0);
     assert(id < nwords_);
-    return words_[id].word;
+    return std::string(arena_.data() + words_[id].offset, words_[id].size);
 }
 
 // The correct implementation of fnv should be:
@@ -133,10 +177,185 @@ void Dictionary::readFromFile(std::istream& in) {
     }
 }
 
+namespace {
+
+// 统计 [begin, end) 内开始的词. 和 readWord 一样, 每个空格或换行结束一个词(可能为空),
+// 文件末尾不以分隔符结束的非空词也算一个
+int64_t countRange(
+        const std::string& filename,
+        int64_t begin,
+        int64_t end,
+        std::unordered_map<std::string, int64_t>& counts,
+        std::atomic<int64_t>& progress,
+        bool report) {
+    std::ifstream ifs(filename);
+    std::streambuf& sb = *ifs.rdbuf();
+    int64_t pos = begin;
+    int c;
+    if (begin > 0) {
+        // 从上一个分隔符之后开始, 跨区间的词属于它开始的区间
+        utils::seek(ifs, begin - 1);
+        pos = begin - 1;
+        while ((c = sb.sbumpc()) != EOF) {
+            pos++;
+            if (c == ' ' || c == '\n') {
+                break;
+            }
+        }
+    }
+
+    const int64_t step = 1000000;
+    int64_t ntokens = 0;
+    std::string word;
+    while (pos < end) {
+        word.clear();
+        bool separated = false;
+        while ((c = sb.sbumpc()) != EOF) {
+            pos++;
+            if (c == ' ' || c == '\n') {
+                separated = true;
+                break;
+            }
+            word.push_back(c);
+        }
+        if (!separated && word.empty()) {
+            break;
+        }
+        counts[word]++;
+        if (++ntokens % step == 0) {
+            progress += step;
+            if (report) {
+                std::cerr << "\rRead " << progress / 1000000 << "M words" << std::flush;
+            }
+        }
+        if (!separated) {
+            break;
+        }
+    }
+    return ntokens;
+}
+
+} // namespace
+
+int64_t Dictionary::countFile(
+        const std::string& filename,
+        int32_t thread,
+        std::unordered_map<std::string, int64_t>& merged,
+        ThreadPool& pool) const {
+    std::ifstream ifs(filename);
+    if (!ifs.is_open()) {
+        throw std::invalid_argument(filename + " cannot be opened for training!");
+    }
+    int64_t size = utils::size(ifs);
+    ifs.close();
+    thread = std::max<int32_t>(1, std::min<int64_t>(thread, size / 4096 + 1));
+
+    std::vector<std::unordered_map<std::string, int64_t>> counts(thread);
+    std::vector<int64_t> ntokens(thread, 0);
+    std::atomic<int64_t> progress(0);
+    auto worker = [&](int32_t i) {
+        ntokens[i] = countRange(
+                filename,
+                i * size / thread,
+                (i + 1) * size / thread,
+                counts[i],
+                progress,
+                i == 0 && args_->verbose > 1);
+    };
+    pool.run(thread, worker);
+
+    for (int32_t i = 1; i < thread; i++) {
+        for (const auto& item : counts[i]) {
+            counts[0][item.first] += item.second;
+        }
+        counts[i].clear();
+    }
+    merged.swap(counts[0]);
+    int64_t total = 0;
+    for (int32_t i = 0; i < thread; i++) {
+        total += ntokens[i];
+    }
+    return total;
+}
+
+void Dictionary::readFromFile(const std::string& filename, int32_t thread, ThreadPool& pool) {
+    std::unordered_map<std::string, int64_t> counts;
+    int64_t ntokens = countFile(filename, thread, counts, pool);
+    words_.clear();
+    arena_.clear();
+    nwords_ = 0;
+    ntokens_ = ntokens;
+    for (const auto& item : counts) {
+        if (item.second >= args_->minCount) {
+            push(item.first, hash(item.first), std::min<int64_t>(item.second, INT32_MAX));
+        }
+    }
+    counts.clear();
+    threshold(args_->minCount);
+    if (args_->verbose > 0) {
+        std::cerr << "\rRead " << ntokens_ / 1000000 << "M words" << std::endl;
+        std::cerr << "Number of words:  " << nwords_ << std::endl;
+    }
+    if (nwords_ == 0) {
+        throw std::invalid_argument(
+                "Empty vocabulary. Try a smaller -minCount value.");
+    }
+}
+
+int64_t Dictionary::extend(const std::string& filename, int32_t thread, ThreadPool& pool) {
+    std::unordered_map<std::string, int64_t> counts;
+    int64_t ntokens = countFile(filename, thread, counts, pool);
+
+    std::vector<std::pair<std::string, int64_t>> added;
+    for (const auto& item : counts) {
+        int32_t id = getId(item.first);
+        if (id >= 0) {
+            words_[id].count = std::min<int64_t>(words_[id].count + item.second, INT32_MAX);
+        } else if (item.second >= args_->minCount) {
+            added.push_back(item);
+        }
+    }
+    counts.clear();
+    // 新词只在新词之间排序, 已有的词 id 不变
+    std::sort(added.begin(), added.end(), [](
+            const std::pair<std::string, int64_t>& l,
+            const std::pair<std::string, int64_t>& r) {
+        if (l.second != r.second) {
+            return l.second > r.second;
+        }
+        return std::lexicographical_compare(
+                (const unsigned char*)l.first.data(),
+                (const unsigned char*)l.first.data() + l.first.size(),
+                (const unsigned char*)r.first.data(),
+                (const unsigned char*)r.first.data() + r.first.size());
+    });
+    for (const auto& item : added) {
+        push(item.first, hash(item.first), std::min<int64_t>(item.second, INT32_MAX));
+    }
+    ntokens_ += ntokens;
+    rehash(int64_t(nwords_ / 0.7) + 1);
+    initTableDiscard();
+    if (args_->verbose > 0) {
+        std::cerr << "\rRead " << ntokens / 1000000 << "M new words" << std::endl;
+        std::cerr << "Number of words:  " << nwords_ << " (" << added.size()
+                  << " new)" << std::endl;
+    }
+    return ntokens;
+}
+
 void Dictionary::threshold(int64_t t) {
 
-    sort(words_.begin(), words_.end(), [](const entry& e1, const entry& e2) {
-        return e1.count > e2.count;
+    // 词频相同时按字典序, 保证多线程和单线程统计出来的词典完全一样
+    const char* arena = arena_.data();
+    sort(words_.begin(), words_.end(), [arena](const entry& e1, const entry& e2) {
+        if (e1.count != e2.count) {
+            return e1.count > e2.count;
+        }
+        return std::lexicographical_compare(
+                (const unsigned char*)arena + e1.offset,
+                (const unsigned char*)arena + e1.offset + e1.size,
+                (const unsigned char*)arena + e2.offset,
+                (const unsigned char*)arena + e2.offset + e2.size);
     });
     words_.erase(
             remove_if(
@@ -147,14 +366,41 @@ void Dictionary::threshold(int64_t t) {
                     }),
             words_.end());
     words_.shrink_to_fit();
-    nwords_ = 0;
-    std::fill(word2int_.begin(), word2int_.end(), -1);
-    for (auto it = words_.begin(); it != words_.end(); ++it) {
-        int32_t h = find(it->word);
-        word2int_[h] = nwords_++;
+    nwords_ = words_.size();
+
+    // 去掉被删除的词, 按新的顺序重新排列 arena
+    std::vector<char> arena2;
+    arena2.reserve(arena_.size());
+    for (auto& e : words_) {
+        arena2.insert(arena2.end(), arena_.begin() + e.offset, arena_.begin() + e.offset + e.size);
+        e.offset = arena2.size() - e.size;
+    }
+    arena2.shrink_to_fit();
+    arena_.swap(arena2);
+    rehash(int64_t(nwords_ / 0.7) + 1);
+    initTableDiscard();
+}
+
+// 按照 word2vec 的 subsampling 公式计算每个词被保留的概率
+void Dictionary::initTableDiscard() {
+    pdiscard_.resize(nwords_);
+    for (int32_t i = 0; i < nwords_; i++) {
+        // t <= 0 时关闭 subsampling, 所有词都保留
+        if (args_->t <= 0) {
+            pdiscard_[i] = 1.0;
+            continue;
+        }
+        real f = real(words_[i].count) / real(ntokens_);
+        pdiscard_[i] = std::sqrt(args_->t / f) + args_->t / f;
     }
 }
 
+bool Dictionary::discard(int32_t id, real rand) const {
+    assert(id >= 0);
+    assert(id < nwords_);
+    return rand > pdiscard_[id];
+}
+
 
 
 std::vector<int32_t> Dictionary::getCounts() const {
@@ -166,10 +412,9 @@ std::vector<int32_t> Dictionary::getCounts() const {
 }
 
 std::vector<int32_t> Dictionary::getIds() const {
-    std::vector<int32_t> ids;
-    for (auto& w : words_) {
-        int32_t hashId = find(w.word);
-        ids.push_back(word2int_[hashId]);
+    std::vector<int32_t> ids(nwords_);
+    for (int32_t i = 0; i < nwords_; i++) {
+        ids[i] = i;
     }
     return ids;
 }
@@ -185,21 +430,23 @@ void Dictionary::reset(std::istream& in) const {
 
 int32_t Dictionary::getLine(
         std::istream& in,
-        std::vector<int32_t>& words) const {
+        std::vector<int32_t>& words,
+        XorShiftRng& rng) const {
     std::string token;
     int32_t ntokens = 0;
 
     reset(in);
     words.clear();
     while (readWord(in, token)) {
-        int32_t h = find(token);
-        int32_t wid = word2int_[h];
+        int32_t wid = getId(token);
         if (wid < 0) { // 没找到word,因此扔掉
             continue;
         }
 
         ntokens++;
-        words.push_back(wid);
+        if (!discard(wid, rng.uniform())) { // 高频词按概率丢弃, 但仍然计入进度
+            words.push_back(wid);
+        }
         if (ntokens > MAX_LINE_SIZE) {
             break;
         }
@@ -208,43 +455,192 @@ int32_t Dictionary::getLine(
 }
 
 
+int32_t Dictionary::getLine(
+        const int32_t* ids,
+        int64_t& pos,
+        int64_t end,
+        std::vector<int32_t>& words,
+        XorShiftRng& rng) const {
+    int32_t ntokens = 0;
+
+    words.clear();
+    while (pos < end) {
+        int32_t wid = ids[pos++];
+        if (wid == EOS) {
+            if (ntokens > 0) {
+                break;
+            }
+            continue;
+        }
+        ntokens++;
+        if (!discard(wid, rng.uniform())) {
+            words.push_back(wid);
+        }
+        if (ntokens > MAX_LINE_SIZE) {
+            break;
+        }
+    }
+    return ntokens;
+}
+
+int64_t Dictionary::encode(std::istream& in, std::ostream& out) const {
+    return encode(in, [&out](std::vector<int32_t>& buffer) {
+        out.write((char*)buffer.data(), buffer.size() * sizeof(int32_t));
+        return bool(out);
+    }, 1 << 16);
+}
+
+int64_t Dictionary::encode(
+        std::istream& in,
+        const std::function<bool(std::vector<int32_t>&)>& sink,
+        size_t chunk) const {
+    std::streambuf& sb = *in.rdbuf();
+    std::vector<int32_t> buffer;
+    std::string token;
+    int64_t size = 0;
+    bool eos = true; // 连续的空行只记录一次句子结束
+    bool open = true;
+    int c;
+
+    auto flush = [&]() {
+        size += buffer.size();
+        open = sink(buffer);
+        buffer.clear();
+        if (buffer.capacity() < chunk) {
+            buffer.reserve(chunk);
+        }
+    };
+    auto push = [&]() {
+        if (!token.empty()) {
+            int32_t wid = getId(token);
+            if (wid >= 0) {
+                buffer.push_back(wid);
+                eos = false;
+            }
+            token.clear();
+        }
+    };
+
+    buffer.reserve(chunk);
+    while (open && (c = sb.sbumpc()) != EOF) {
+        if (c == ' ' || c == '\n') {
+            push();
+            if (c == '\n' && !eos) {
+                buffer.push_back(EOS);
+                eos = true;
+            }
+            // 尽量等到句子结束再切, 超长的句子也不会让块无限增长
+            if (buffer.size() >= chunk && (eos || buffer.size() >= 2 * chunk)) {
+                flush();
+            }
+        } else {
+            token.push_back(c);
+        }
+    }
+    if (!open) {
+        return size;
+    }
+    push();
+    if (!eos) {
+        buffer.push_back(EOS);
+    }
+    if (!buffer.empty()) {
+        flush();
+    }
+    return size;
+}
+
 void Dictionary::save(std::ostream& out) const {
     out.write((char*)&nwords_, sizeof(int32_t));
     out.write((char*)&ntokens_, sizeof(int64_t));
     for (int32_t i = 0; i < nwords_; i++) {
-        entry e = words_[i];
-        out.write(e.word.data(), e.word.size() * sizeof(char));
+        const entry& e = words_[i];
+        int64_t count = e.count;
+        out.write(arena_.data() + e.offset, e.size * sizeof(char));
         out.put(0);
-        out.write((char*)&(e.count), sizeof(int64_t));
+        out.write((char*)&(count), sizeof(int64_t));
     }
 }
 
 void Dictionary::load(std::istream& in) {
+    int32_t nwords;
     words_.clear();
-    in.read((char*)&nwords_, sizeof(int32_t));
+    arena_.clear();
+    nwords_ = 0;
+    in.read((char*)&nwords, sizeof(int32_t));
     in.read((char*)&ntokens_, sizeof(int64_t));
-    for (int32_t i = 0; i < nwords_; i++) {
+    std::string word;
+    for (int32_t i = 0; i < nwords; i++) {
         char c;
-        entry e;
+        int64_t count;
+        word.clear();
         while ((c = in.get()) != 0) {
-            e.word.push_back(c);
+            word.push_back(c);
         }
-        in.read((char*)&e.count, sizeof(int64_t));
-        words_.push_back(e);
+        in.read((char*)&count, sizeof(int64_t));
+        push(word, hash(word), int32_t(count));
+    }
+
+    rehash(int64_t(nwords_ / 0.7) + 1);
+    initTableDiscard();
+}
+
+
+void Dictionary::savePrebuilt(std::ostream& out) const {
+    int64_t tableSize = table_.size();
+    std::vector<int32_t> counts = getCounts();
+    std::vector<int64_t> offsets(nwords_ + 1, 0);
+    for (int32_t i = 0; i < nwords_; i++) {
+        offsets[i + 1] = offsets[i] + words_[i].size;
     }
 
-    int32_t word2intsize = std::ceil(nwords_ / 0.7);
-    word2int_.assign(word2intsize, -1);
+    out.write((char*)&nwords_, sizeof(int32_t));
+    out.write((char*)&ntokens_, sizeof(int64_t));
+    out.write((char*)&tableSize, sizeof(int64_t));
+    out.write((char*)table_.data(), tableSize * sizeof(slot));
+    out.write((char*)counts.data(), nwords_ * sizeof(int32_t));
+    out.write((char*)offsets.data(), (nwords_ + 1) * sizeof(int64_t));
     for (int32_t i = 0; i < nwords_; i++) {
-        word2int_[find(words_[i].word)] = i;
+        out.write(arena_.data() + words_[i].offset, words_[i].size);
     }
 }
 
+void Dictionary::loadPrebuilt(std::istream& in) {
+    int64_t tableSize;
+    in.read((char*)&nwords_, sizeof(int32_t));
+    in.read((char*)&ntokens_, sizeof(int64_t));
+    in.read((char*)&tableSize, sizeof(int64_t));
+    table_.resize(tableSize);
+    in.read((char*)table_.data(), tableSize * sizeof(slot));
+    std::vector<int32_t> counts(nwords_);
+    std::vector<int64_t> offsets(nwords_ + 1);
+    in.read((char*)counts.data(), nwords_ * sizeof(int32_t));
+    in.read((char*)offsets.data(), (nwords_ + 1) * sizeof(int64_t));
+    arena_.resize(offsets[nwords_]);
+    in.read(arena_.data(), arena_.size());
+    if (!in) {
+        throw std::invalid_argument("Dictionary is truncated!");
+    }
+
+    words_.resize(nwords_);
+    for (int32_t i = 0; i < nwords_; i++) {
+        words_[i].offset = offsets[i];
+        words_[i].size = offsets[i + 1] - offsets[i];
+        words_[i].count = counts[i];
+    }
+    for (const auto& s : table_) {
+        if (s.id != -1) {
+            words_[s.id].hash = s.hash;
+        }
+    }
+    initTableDiscard();
+}
 
 void Dictionary::dump(std::ostream& out) const {
     out << words_.size() << std::endl;
-    for (auto it : words_) {
-        out << it.word << " " << it.count  << std::endl;
+    for (int32_t i = 0; i < nwords_; i++) {
+        out.write(arena_.data() + words_[i].offset, words_[i].size);
+        out << " " << words_[i].count << std::endl;
     }
 }
 
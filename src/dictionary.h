@@ -5,56 +5,107 @@
 #ifndef WORD2VEC_DICTIONARY_H
 #define WORD2VEC_DICTIONARY_H
 
+#include <functional>
 #include <istream>
 #include <memory>
 #include <ostream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "args.h"
 #include "real.h"
+#include "rng.h"
+#include "thread_pool.h"
 
 namespace word2vec {
 
+// 词本身存放在 Dictionary 的 arena_ 里, entry 只记录位置
 struct entry {
-    std::string word;
+    int64_t offset;
+    int32_t size;
     int32_t count;
+    uint32_t hash;
+};
+
+// 开放寻址 hash 表的一个槽位, 缓存 hash 值, 探测时 hash 不同就不用比较字符串
+struct slot {
+    uint32_t hash;
+    int32_t id;
 };
 
 class Dictionary {
 protected:
     static const int32_t MAX_VOCAB_SIZE = 30000000;
-    static const int32_t MAX_LINE_SIZE = 1024;
+    static const int32_t MIN_TABLE_SIZE = 1024;
 
     int32_t find(const std::string&) const;
     int32_t find(const std::string&, uint32_t h) const;
+    bool equals(int32_t, const std::string&) const;
+    int32_t push(const std::string&, uint32_t h, int32_t count);
+    void rehash(int64_t capacity);
 
+    // 多线程统计一个文件里每个词出现的次数, 返回总词数
+    int64_t countFile(
+            const std::string& filename,
+            int32_t thread,
+            std::unordered_map<std::string, int64_t>& counts,
+            ThreadPool& pool) const;
+
+    void initTableDiscard();
     void reset(std::istream&) const;
 
     std::shared_ptr<Args> args_;
-    std::vector<int32_t> word2int_; // 这个是对应的hash表
+    std::vector<slot> table_; // 这个是对应的hash表, 大小是 2 的幂, 随词表增长
+    std::vector<char> arena_; // 所有词连续存放
     std::vector<entry> words_;
+    std::vector<real> pdiscard_; // 高频词的保留概率, 用于 subsampling
 
     int32_t nwords_; //
     int64_t ntokens_;
 
 public:
+    static const int32_t MAX_LINE_SIZE = 1024;
+    static const int32_t EOS = -1; // 编码后的语料中表示句子结束
+
     explicit Dictionary(std::shared_ptr<Args>);
     explicit Dictionary(std::shared_ptr<Args>, std::istream&);
     int32_t nwords() const;
     int64_t ntokens() const;
     int32_t getId(const std::string&) const;
     std::string getWord(int32_t) const;
+    bool discard(int32_t, real) const;
     uint32_t hash(const std::string& str) const;
     void add(const std::string&);
 
     bool readWord(std::istream&, std::string&) const;
     void readFromFile(std::istream&);
+    // 多线程统计词频: 按字节区间切分文件, 每个线程单独计数后合并, 结果和单线程版本一致
+    void readFromFile(const std::string& filename, int32_t thread, ThreadPool& pool);
+    // 增量训练: 已有词累加新文件里的词频, 新词追加在末尾, 已有词的 id 不变, 返回新文件的词数
+    int64_t extend(const std::string& filename, int32_t thread, ThreadPool& pool);
     void save(std::ostream&) const;
     void load(std::istream&);
+    // hash 表连同词一起按数组整块存储, 加载时不需要逐字符读取和重新 hash;
+    // 加载仍然会把这些数组拷贝进内存并重建 words_, 耗时和词表大小成正比
+    void savePrebuilt(std::ostream&) const;
+    void loadPrebuilt(std::istream&);
     std::vector<int32_t> getCounts() const;
     std::vector<int32_t> getIds() const;
-    int32_t getLine(std::istream&, std::vector<int32_t>&) const; // 训练模型的时候用到，调用前词典已经生成
+    int32_t getLine(std::istream&, std::vector<int32_t>&, XorShiftRng&) const; // 训练模型的时候用到，调用前词典已经生成
+    // 从编码后的 id 序列 [pos, end) 里取一句, pos 移到句子之后
+    int32_t getLine(
+            const int32_t* ids,
+            int64_t& pos,
+            int64_t end,
+            std::vector<int32_t>&,
+            XorShiftRng&) const;
+    int64_t encode(std::istream&, std::ostream&) const; // 把文本转成 int32 的 id 序列, 返回写入的 id 个数
+    // 同上, 每攒够 chunk 个 id 就交给 sink, 块尽量在句子结束处切开; sink 返回 false 时停止读取
+    int64_t encode(
+            std::istream&,
+            const std::function<bool(std::vector<int32_t>&)>& sink,
+            size_t chunk) const;
     void threshold(int64_t);
     void dump(std::ostream&) const;
 };
@@ -0,0 +1,447 @@
+//
+// Created by fengjiaxin on 2023/5/22.
+//
+
+#include "distributed.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "vector.h"
+
+namespace word2vec {
+
+namespace {
+
+const std::string UNIX_PREFIX = "unix:";
+const int32_t CONNECT_RETRIES = 600; // worker 可能比 rank 0 先启动, 每 100ms 重试一次
+
+void sendAll(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error(std::string("Lost connection to a peer: ") + strerror(errno));
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+void recvAll(int fd, void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = ::recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("Lost connection to a peer!");
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+template <typename T>
+void sendValue(int fd, T value) {
+    sendAll(fd, &value, sizeof(T));
+}
+
+template <typename T>
+T recvValue(int fd) {
+    T value;
+    recvAll(fd, &value, sizeof(T));
+    return value;
+}
+
+// "unix:/path" 是 Unix socket, 其余按 host:port 解析
+bool isUnix(const std::string& address) {
+    return address.compare(0, UNIX_PREFIX.size(), UNIX_PREFIX) == 0;
+}
+
+sockaddr_un unixAddress(const std::string& address) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::string path = address.substr(UNIX_PREFIX.size());
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        throw std::invalid_argument(address + " is not a valid socket path!");
+    }
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+addrinfo* tcpAddress(const std::string& address, bool passive) {
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        throw std::invalid_argument(address + " should be host:port or unix:path!");
+    }
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result) != 0) {
+        throw std::invalid_argument(address + " cannot be resolved!");
+    }
+    return result;
+}
+
+void setNoDelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+} // namespace
+
+ParameterSync::ParameterSync(
+        std::shared_ptr<Args> args,
+        std::shared_ptr<Matrix> input,
+        std::shared_ptr<Matrix> output)
+        : args_(args), params_{input, output}, rounds_(0), rows_(0) {
+    if (isMaster()) {
+        listen();
+    } else {
+        connect();
+    }
+    for (const auto& param : params_) {
+        Matrix base(param->size(0), param->size(1));
+        Vector vec(param->size(1));
+        for (int64_t i = 0; i < param->size(0); i++) {
+            vec.zero();
+            param->addRowToVector(vec, i);
+            std::copy(vec.data(), vec.data() + vec.size(), base.row(i));
+        }
+        base_.push_back(std::move(base));
+        if (isMaster()) {
+            sums_.emplace_back(param->size(0), param->size(1));
+            sums_.back().zero();
+            counts_.emplace_back(param->size(0), 0);
+        }
+    }
+}
+
+ParameterSync::~ParameterSync() {
+    for (int fd : peers_) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+bool ParameterSync::isMaster() const {
+    return args_->rank == 0;
+}
+
+int64_t ParameterSync::rounds() const {
+    return rounds_;
+}
+
+int64_t ParameterSync::rows() const {
+    return rows_;
+}
+
+// rank 0 等所有 worker 连上, 核对词表和矩阵大小, 再把自己的初始参数发过去
+void ParameterSync::listen() {
+    int server = -1;
+    if (isUnix(args_->master)) {
+        sockaddr_un addr = unixAddress(args_->master);
+        unlink(addr.sun_path);
+        server = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (server < 0 || bind(server, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            throw std::runtime_error(args_->master + " cannot be bound!");
+        }
+    } else {
+        addrinfo* info = tcpAddress(args_->master, true);
+        server = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        int one = 1;
+        setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        bool bound = server >= 0 && bind(server, info->ai_addr, info->ai_addrlen) == 0;
+        freeaddrinfo(info);
+        if (!bound) {
+            throw std::runtime_error(args_->master + " cannot be bound!");
+        }
+    }
+    if (::listen(server, args_->world) != 0) {
+        close(server);
+        throw std::runtime_error(args_->master + " cannot be listened on!");
+    }
+    if (args_->verbose > 0) {
+        std::cerr << "Waiting for " << args_->world - 1 << " workers on " << args_->master
+                  << std::endl;
+    }
+
+    peers_.assign(args_->world - 1, -1);
+    for (int32_t i = 1; i < args_->world; i++) {
+        int fd = accept(server, nullptr, nullptr);
+        if (fd < 0) {
+            close(server);
+            throw std::runtime_error("Failed to accept a worker!");
+        }
+        if (!isUnix(args_->master)) {
+            setNoDelay(fd);
+        }
+        int32_t rank = recvValue<int32_t>(fd);
+        if (rank <= 0 || rank >= args_->world || peers_[rank - 1] >= 0) {
+            close(fd);
+            close(server);
+            throw std::runtime_error("Worker " + std::to_string(rank) + " is unexpected!");
+        }
+        peers_[rank - 1] = fd;
+        for (const auto& param : params_) {
+            int64_t m = recvValue<int64_t>(fd);
+            int64_t n = recvValue<int64_t>(fd);
+            if (m != param->size(0) || n != param->size(1)) {
+                close(server);
+                throw std::runtime_error(
+                        "Worker " + std::to_string(rank) + " has a different vocabulary or dim!");
+            }
+        }
+    }
+    close(server);
+    if (isUnix(args_->master)) {
+        unlink(unixAddress(args_->master).sun_path);
+    }
+
+    // 所有进程从同一份参数开始
+    for (const auto& param : params_) {
+        Vector vec(param->size(1));
+        for (int64_t i = 0; i < param->size(0); i++) {
+            vec.zero();
+            param->addRowToVector(vec, i);
+            for (int fd : peers_) {
+                sendAll(fd, vec.data(), vec.size() * sizeof(real));
+            }
+        }
+    }
+}
+
+void ParameterSync::connect() {
+    int fd = -1;
+    for (int32_t retry = 0; fd < 0 && retry < CONNECT_RETRIES; retry++) {
+        if (isUnix(args_->master)) {
+            sockaddr_un addr = unixAddress(args_->master);
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd >= 0 && ::connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        } else {
+            addrinfo* info = tcpAddress(args_->master, false);
+            fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+            if (fd >= 0 && ::connect(fd, info->ai_addr, info->ai_addrlen) != 0) {
+                close(fd);
+                fd = -1;
+            }
+            freeaddrinfo(info);
+            if (fd >= 0) {
+                setNoDelay(fd);
+            }
+        }
+        if (fd < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+    if (fd < 0) {
+        throw std::runtime_error(args_->master + " cannot be connected!");
+    }
+    peers_.assign(1, fd);
+    sendValue<int32_t>(fd, args_->rank);
+    for (const auto& param : params_) {
+        sendValue<int64_t>(fd, param->size(0));
+        sendValue<int64_t>(fd, param->size(1));
+    }
+
+    for (const auto& param : params_) {
+        Vector vec(param->size(1));
+        param->zero();
+        for (int64_t i = 0; i < param->size(0); i++) {
+            recvAll(fd, vec.data(), vec.size() * sizeof(real));
+            param->addVectorToRow(vec, i, 1.0);
+        }
+    }
+}
+
+// 和 base_ 不同的行就是上次同步之后本进程改动过的行
+void ParameterSync::collect(size_t k, Delta& delta) const {
+    const Matrix& param = *params_[k];
+    const Matrix& base = base_[k];
+    const int64_t n = param.size(1);
+    Vector vec(n);
+    delta.ids.clear();
+    delta.values.clear();
+    for (int64_t i = 0; i < param.size(0); i++) {
+        vec.zero();
+        param.addRowToVector(vec, i);
+        const real* b = base.row(i);
+        if (std::equal(b, b + n, vec.data())) {
+            continue;
+        }
+        delta.ids.push_back(i);
+        for (int64_t j = 0; j < n; j++) {
+            delta.values.push_back(vec[j] - b[j]);
+        }
+    }
+}
+
+// 参数加上 (平均增量 - 自己的增量), base_ 加上平均增量
+void ParameterSync::apply(size_t k, const Delta& own, const Delta& average) {
+    Matrix& param = *params_[k];
+    Matrix& base = base_[k];
+    const int64_t n = param.size(1);
+    Vector diff(n);
+    size_t p = 0;
+    for (size_t a = 0; a < average.ids.size(); a++) {
+        const int32_t id = average.ids[a];
+        const real* avg = average.values.data() + a * n;
+        while (p < own.ids.size() && own.ids[p] < id) {
+            p++;
+        }
+        const real* mine = p < own.ids.size() && own.ids[p] == id ? own.values.data() + p * n
+                                                                   : nullptr;
+        real* b = base.row(id);
+        for (int64_t j = 0; j < n; j++) {
+            diff[j] = avg[j] - (mine ? mine[j] : 0.0);
+            b[j] += avg[j];
+        }
+        param.addVectorToRow(diff, id, 1.0);
+    }
+}
+
+void ParameterSync::average(size_t k, const std::vector<const Delta*>& deltas, Delta& result) {
+    Matrix& sums = sums_[k];
+    std::vector<int32_t>& counts = counts_[k];
+    const int64_t n = sums.size(1);
+    result.ids.clear();
+    result.values.clear();
+    for (const Delta* delta : deltas) {
+        for (size_t r = 0; r < delta->ids.size(); r++) {
+            const int32_t id = delta->ids[r];
+            if (counts[id]++ == 0) {
+                result.ids.push_back(id);
+            }
+            const real* values = delta->values.data() + r * n;
+            real* sum = sums.row(id);
+            for (int64_t j = 0; j < n; j++) {
+                sum[j] += values[j];
+            }
+        }
+    }
+    std::sort(result.ids.begin(), result.ids.end());
+    result.values.resize(result.ids.size() * n);
+    for (size_t r = 0; r < result.ids.size(); r++) {
+        const int32_t id = result.ids[r];
+        real* sum = sums.row(id);
+        for (int64_t j = 0; j < n; j++) {
+            result.values[r * n + j] = sum[j] / counts[id];
+            sum[j] = 0.0;
+        }
+        counts[id] = 0;
+    }
+}
+
+void ParameterSync::sendDelta(int fd, const Delta& delta) const {
+    sendValue<int32_t>(fd, delta.ids.size());
+    sendAll(fd, delta.ids.data(), delta.ids.size() * sizeof(int32_t));
+    sendAll(fd, delta.values.data(), delta.values.size() * sizeof(real));
+}
+
+void ParameterSync::recvDelta(int fd, size_t k, Delta& delta) const {
+    const int64_t n = params_[k]->size(1);
+    int32_t size = recvValue<int32_t>(fd);
+    if (size < 0 || size > params_[k]->size(0)) {
+        throw std::runtime_error("Received a corrupted update!");
+    }
+    delta.ids.resize(size);
+    delta.values.resize(size * n);
+    recvAll(fd, delta.ids.data(), delta.ids.size() * sizeof(int32_t));
+    recvAll(fd, delta.values.data(), delta.values.size() * sizeof(real));
+    for (int32_t id : delta.ids) {
+        if (id < 0 || id >= params_[k]->size(0)) {
+            throw std::runtime_error("Received a corrupted update!");
+        }
+    }
+}
+
+void ParameterSync::serve() {
+    const size_t nparams = params_.size();
+    std::vector<bool> active(peers_.size(), true);
+    std::vector<std::vector<Delta>> received(peers_.size(), std::vector<Delta>(nparams));
+    std::vector<Delta> own(nparams);
+    std::vector<Delta> result(nparams);
+    while (std::find(active.begin(), active.end(), true) != active.end()) {
+        std::vector<bool> last(peers_.size(), false);
+        for (size_t p = 0; p < peers_.size(); p++) {
+            if (!active[p]) {
+                continue;
+            }
+            last[p] = recvValue<int32_t>(peers_[p]) != 0;
+            for (size_t k = 0; k < nparams; k++) {
+                recvDelta(peers_[p], k, received[p][k]);
+            }
+        }
+        for (size_t k = 0; k < nparams; k++) {
+            collect(k, own[k]);
+            std::vector<const Delta*> deltas{&own[k]};
+            for (size_t p = 0; p < peers_.size(); p++) {
+                if (active[p]) {
+                    deltas.push_back(&received[p][k]);
+                }
+            }
+            average(k, deltas, result[k]);
+            apply(k, own[k], result[k]);
+            rows_ += result[k].ids.size();
+        }
+        for (size_t p = 0; p < peers_.size(); p++) {
+            if (!active[p]) {
+                continue;
+            }
+            for (size_t k = 0; k < nparams; k++) {
+                sendDelta(peers_[p], result[k]);
+            }
+            if (last[p]) {
+                active[p] = false;
+            }
+        }
+        rounds_++;
+    }
+}
+
+void ParameterSync::sync(bool last) {
+    const int fd = peers_[0];
+    std::vector<Delta> own(params_.size());
+    Delta result;
+    sendValue<int32_t>(fd, last ? 1 : 0);
+    for (size_t k = 0; k < params_.size(); k++) {
+        collect(k, own[k]);
+        sendDelta(fd, own[k]);
+    }
+    for (size_t k = 0; k < params_.size(); k++) {
+        recvDelta(fd, k, result);
+        apply(k, own[k], result);
+        rows_ += result.ids.size();
+    }
+    rounds_++;
+}
+
+} // namespace word2vec
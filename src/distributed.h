@@ -0,0 +1,67 @@
+//
+// Created by fengjiaxin on 2023/5/22.
+// 多进程数据并行训练: 每个进程训练语料的一个分片, 定期通过 socket 交换改动过的行
+
+#ifndef WORD2VEC_DISTRIBUTED_H
+#define WORD2VEC_DISTRIBUTED_H
+
+#include <memory>
+#include <vector>
+
+#include "args.h"
+#include "matrix.h"
+#include "real.h"
+
+namespace word2vec {
+
+// rank 0 是汇总节点, 其他进程启动时连上来并拷贝 rank 0 的初始参数.
+// 每一轮每个进程把上次同步之后变化过的行(相对 base_ 的增量)发给 rank 0,
+// rank 0 对每一行在改动过它的进程之间取增量的平均, 再发回给所有进程.
+// 训练线程不停下来, 应用时用平均增量替换掉自己发出去的那部分, 同步期间的新改动保留
+class ParameterSync {
+private:
+    // 一个矩阵里变化过的行, ids 升序, values 按行连续存放
+    struct Delta {
+        std::vector<int32_t> ids;
+        std::vector<real> values;
+    };
+
+    std::shared_ptr<Args> args_;
+    std::vector<std::shared_ptr<Matrix>> params_; // input_ 和 output_
+    std::vector<Matrix> base_; // 上次同步之后的值, 用 fp32 保存
+    std::vector<int> peers_; // rank 0: 每个 worker 的连接; worker: 到 rank 0 的连接
+    std::vector<Matrix> sums_; // rank 0 汇总增量用
+    std::vector<std::vector<int32_t>> counts_;
+    int64_t rounds_;
+    int64_t rows_;
+
+    void listen();
+    void connect();
+    void collect(size_t k, Delta& delta) const;
+    void apply(size_t k, const Delta& own, const Delta& average);
+    void average(size_t k, const std::vector<const Delta*>& deltas, Delta& result);
+    void sendDelta(int fd, const Delta& delta) const;
+    void recvDelta(int fd, size_t k, Delta& delta) const;
+
+public:
+    ParameterSync(
+            std::shared_ptr<Args> args,
+            std::shared_ptr<Matrix> input,
+            std::shared_ptr<Matrix> output);
+    ~ParameterSync();
+
+    ParameterSync(const ParameterSync&) = delete;
+    ParameterSync& operator=(const ParameterSync&) = delete;
+
+    bool isMaster() const;
+    // rank 0: 每一轮等所有还在训练的 worker 发来增量, 直到它们都发完最后一轮
+    void serve();
+    // worker: 做一轮同步, last 表示本进程的训练已经结束
+    void sync(bool last);
+    int64_t rounds() const;
+    int64_t rows() const;
+};
+
+} // namespace word2vec
+
+#endif //WORD2VEC_DISTRIBUTED_H
@@ -0,0 +1,391 @@
+//
+// Created by fengjiaxin on 2023/5/15.
+//
+
+#include "hnsw.h"
+#include "kernels.h"
+#include "rng.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <functional>
+#include <queue>
+#include <stdexcept>
+
+namespace word2vec {
+
+namespace {
+
+// 每个线程一份访问标记, 用递增的 tag 代替每次查询清空数组
+struct VisitedList {
+    std::vector<uint32_t> marks;
+    uint32_t tag = 0;
+
+    void reset(size_t n) {
+        if (marks.size() < n) {
+            marks.assign(n, 0);
+            tag = 0;
+        }
+        if (++tag == 0) {
+            std::fill(marks.begin(), marks.end(), 0);
+            tag = 1;
+        }
+    }
+
+    bool visit(int32_t i) {
+        if (marks[i] == tag) {
+            return false;
+        }
+        marks[i] = tag;
+        return true;
+    }
+};
+
+thread_local VisitedList visited;
+
+} // namespace
+
+HnswIndex::HnswIndex(
+        const Matrix& vectors,
+        int32_t M,
+        int32_t efConstruction,
+        int32_t thread,
+        ThreadPool& pool)
+        : vectors_(vectors),
+          M_(M),
+          maxM0_(2 * M),
+          efConstruction_(efConstruction),
+          maxLevel_(-1),
+          entryPoint_(-1) {
+    if (M < 2) {
+        throw std::invalid_argument("M needs to be 2 or higher!");
+    }
+    int32_t n = vectors_.rows();
+    double levelMult = 1.0 / std::log(double(M_));
+    XorShiftRng rng(n);
+    levels_.resize(n);
+    upper_.resize(n);
+    for (int32_t i = 0; i < n; i++) {
+        levels_[i] = int32_t(-std::log(1.0 - rng.uniform()) * levelMult);
+        upper_[i].assign(levels_[i] * (M_ + 1), 0);
+    }
+    links0_.assign(int64_t(n) * (maxM0_ + 1), 0);
+    if (n == 0) {
+        return;
+    }
+
+    std::vector<std::mutex> locks(n);
+    std::mutex global;
+    insert(0, locks.data(), global);
+    std::atomic<int32_t> next(1);
+    pool.run(thread, [&](int32_t) {
+        int32_t node;
+        while ((node = next++) < n) {
+            insert(node, locks.data(), global);
+        }
+    });
+}
+
+HnswIndex::HnswIndex(const Matrix& vectors, std::istream& in)
+        : vectors_(vectors),
+          M_(0),
+          maxM0_(0),
+          efConstruction_(0),
+          maxLevel_(-1),
+          entryPoint_(-1) {
+    load(in);
+}
+
+const real* HnswIndex::row(int32_t node) const {
+    return vectors_.row(node);
+}
+
+real HnswIndex::similarity(const real* query, int32_t node) const {
+    return kernels::dot(query, row(node), vectors_.cols());
+}
+
+int32_t HnswIndex::maxNeighbors(int32_t level) const {
+    return level == 0 ? maxM0_ : M_;
+}
+
+int32_t* HnswIndex::neighbors(int32_t node, int32_t level) {
+    if (level == 0) {
+        return links0_.data() + int64_t(node) * (maxM0_ + 1);
+    }
+    return upper_[node].data() + (level - 1) * (M_ + 1);
+}
+
+const int32_t* HnswIndex::neighbors(int32_t node, int32_t level) const {
+    if (level == 0) {
+        return links0_.data() + int64_t(node) * (maxM0_ + 1);
+    }
+    return upper_[node].data() + (level - 1) * (M_ + 1);
+}
+
+// 建索引的时候其他线程可能正在修改邻居表, 需要加锁拷贝一份
+void HnswIndex::copyNeighbors(
+        int32_t node,
+        int32_t level,
+        std::vector<int32_t>& out,
+        std::mutex* locks) const {
+    std::unique_lock<std::mutex> lock;
+    if (locks) {
+        lock = std::unique_lock<std::mutex>(locks[node]);
+    }
+    const int32_t* links = neighbors(node, level);
+    out.assign(links + 1, links + 1 + links[0]);
+}
+
+int32_t HnswIndex::greedySearch(
+        const real* query,
+        int32_t ep,
+        int32_t top,
+        int32_t bottom,
+        std::mutex* locks) const {
+    real best = similarity(query, ep);
+    std::vector<int32_t> links;
+    for (int32_t level = top; level > bottom; level--) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            copyNeighbors(ep, level, links, locks);
+            for (int32_t nb : links) {
+                real s = similarity(query, nb);
+                if (s > best) {
+                    best = s;
+                    ep = nb;
+                    changed = true;
+                }
+            }
+        }
+    }
+    return ep;
+}
+
+std::vector<HnswIndex::Candidate> HnswIndex::searchLayer(
+        const real* query,
+        int32_t ep,
+        int32_t ef,
+        int32_t level,
+        std::mutex* locks) const {
+    // candidates 先扩展最相似的, results 堆顶是目前结果里最差的
+    std::priority_queue<Candidate> candidates;
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>>
+            results;
+    std::vector<int32_t> links;
+
+    visited.reset(levels_.size());
+    visited.visit(ep);
+    real s = similarity(query, ep);
+    candidates.emplace(s, ep);
+    results.emplace(s, ep);
+
+    while (!candidates.empty()) {
+        Candidate c = candidates.top();
+        if (results.size() >= ef && c.first < results.top().first) {
+            break;
+        }
+        candidates.pop();
+        copyNeighbors(c.second, level, links, locks);
+        for (int32_t nb : links) {
+            if (!visited.visit(nb)) {
+                continue;
+            }
+            s = similarity(query, nb);
+            if (results.size() < ef || s > results.top().first) {
+                candidates.emplace(s, nb);
+                results.emplace(s, nb);
+                if (results.size() > ef) {
+                    results.pop();
+                }
+            }
+        }
+    }
+
+    std::vector<Candidate> out(results.size());
+    for (int32_t i = out.size() - 1; i >= 0; i--) {
+        out[i] = results.top();
+        results.pop();
+    }
+    return out;
+}
+
+// HNSW 论文里的启发式: 只保留离 query 比离已选邻居都更近的候选, 让邻居分布在不同方向
+std::vector<int32_t> HnswIndex::selectNeighbors(
+        std::vector<Candidate>& candidates,
+        int32_t m) const {
+    std::sort(candidates.begin(), candidates.end(), std::greater<Candidate>());
+    std::vector<int32_t> selected;
+    for (const auto& c : candidates) {
+        if (selected.size() >= m) {
+            break;
+        }
+        bool good = true;
+        for (int32_t r : selected) {
+            if (similarity(row(c.second), r) > c.first) {
+                good = false;
+                break;
+            }
+        }
+        if (good) {
+            selected.push_back(c.second);
+        }
+    }
+    return selected;
+}
+
+void HnswIndex::connect(
+        int32_t node,
+        int32_t level,
+        const std::vector<int32_t>& selected,
+        std::mutex* locks) {
+    int32_t maxM = maxNeighbors(level);
+    {
+        // node 在更高的层已经可以被搜到, 其他线程可能先给它连了回边, 合并而不是覆盖
+        std::lock_guard<std::mutex> lock(locks[node]);
+        int32_t* links = neighbors(node, level);
+        std::vector<int32_t> merged(links + 1, links + 1 + links[0]);
+        for (int32_t nb : selected) {
+            if (std::find(merged.begin(), merged.end(), nb) == merged.end()) {
+                merged.push_back(nb);
+            }
+        }
+        if (merged.size() > maxM) {
+            std::vector<Candidate> candidates;
+            const real* q = row(node);
+            for (int32_t nb : merged) {
+                candidates.emplace_back(similarity(q, nb), nb);
+            }
+            merged = selectNeighbors(candidates, maxM);
+        }
+        links[0] = merged.size();
+        std::copy(merged.begin(), merged.end(), links + 1);
+    }
+
+    for (int32_t nb : selected) {
+        std::lock_guard<std::mutex> lock(locks[nb]);
+        int32_t* links = neighbors(nb, level);
+        if (links[0] < maxM) {
+            links[1 + links[0]++] = node;
+            continue;
+        }
+        // 邻居已满, 重新挑选 nb 的邻居
+        std::vector<Candidate> candidates;
+        const real* q = row(nb);
+        candidates.emplace_back(similarity(q, node), node);
+        for (int32_t j = 1; j <= links[0]; j++) {
+            candidates.emplace_back(similarity(q, links[j]), links[j]);
+        }
+        std::vector<int32_t> kept = selectNeighbors(candidates, maxM);
+        links[0] = kept.size();
+        std::copy(kept.begin(), kept.end(), links + 1);
+    }
+}
+
+void HnswIndex::insert(int32_t node, std::mutex* locks, std::mutex& global) {
+    int32_t level = levels_[node];
+    std::unique_lock<std::mutex> lock(global);
+    int32_t ep = entryPoint_;
+    int32_t top = maxLevel_;
+    if (level <= top) {
+        lock.unlock();
+    }
+
+    const real* query = row(node);
+    if (ep >= 0) {
+        ep = greedySearch(query, ep, top, level, locks);
+        for (int32_t lc = std::min(level, top); lc >= 0; lc--) {
+            std::vector<Candidate> found =
+                    searchLayer(query, ep, efConstruction_, lc, locks);
+            found.erase(
+                    std::remove_if(
+                            found.begin(),
+                            found.end(),
+                            [&](const Candidate& c) { return c.second == node; }),
+                    found.end());
+            if (found.empty()) {
+                continue;
+            }
+            ep = found.front().second;
+            connect(node, lc, selectNeighbors(found, M_), locks);
+        }
+    }
+    if (level > top) {
+        entryPoint_ = node;
+        maxLevel_ = level;
+    }
+}
+
+std::vector<std::pair<real, int32_t>> HnswIndex::search(
+        const real* query,
+        int32_t k,
+        int32_t ef) const {
+    if (entryPoint_ < 0) {
+        return {};
+    }
+    int32_t ep = greedySearch(query, entryPoint_, maxLevel_, 0, nullptr);
+    std::vector<Candidate> found =
+            searchLayer(query, ep, std::max(ef, k), 0, nullptr);
+    if (found.size() > k) {
+        found.resize(k);
+    }
+    return found;
+}
+
+void HnswIndex::save(std::ostream& out) const {
+    const int32_t magic = HNSW_MAGIC_INT32;
+    const int32_t version = HNSW_VERSION;
+    int64_t n = vectors_.rows();
+    int64_t dim = vectors_.cols();
+    out.write((char*)&magic, sizeof(int32_t));
+    out.write((char*)&version, sizeof(int32_t));
+    out.write((char*)&n, sizeof(int64_t));
+    out.write((char*)&dim, sizeof(int64_t));
+    out.write((char*)&M_, sizeof(int32_t));
+    out.write((char*)&efConstruction_, sizeof(int32_t));
+    out.write((char*)&maxLevel_, sizeof(int32_t));
+    out.write((char*)&entryPoint_, sizeof(int32_t));
+    out.write((char*)levels_.data(), n * sizeof(int32_t));
+    out.write((char*)links0_.data(), links0_.size() * sizeof(int32_t));
+    for (const auto& links : upper_) {
+        out.write((char*)links.data(), links.size() * sizeof(int32_t));
+    }
+}
+
+void HnswIndex::load(std::istream& in) {
+    int32_t magic;
+    int32_t version;
+    int64_t n;
+    int64_t dim;
+    in.read((char*)&magic, sizeof(int32_t));
+    in.read((char*)&version, sizeof(int32_t));
+    if (!in || magic != HNSW_MAGIC_INT32 || version != HNSW_VERSION) {
+        throw std::invalid_argument("Index has wrong file format!");
+    }
+    in.read((char*)&n, sizeof(int64_t));
+    in.read((char*)&dim, sizeof(int64_t));
+    if (n != vectors_.rows() || dim != vectors_.cols()) {
+        throw std::invalid_argument("Index does not match the model!");
+    }
+    in.read((char*)&M_, sizeof(int32_t));
+    in.read((char*)&efConstruction_, sizeof(int32_t));
+    in.read((char*)&maxLevel_, sizeof(int32_t));
+    in.read((char*)&entryPoint_, sizeof(int32_t));
+    maxM0_ = 2 * M_;
+    levels_.resize(n);
+    in.read((char*)levels_.data(), n * sizeof(int32_t));
+    links0_.resize(n * (maxM0_ + 1));
+    in.read((char*)links0_.data(), links0_.size() * sizeof(int32_t));
+    upper_.resize(n);
+    for (int64_t i = 0; i < n; i++) {
+        upper_[i].resize(levels_[i] * (M_ + 1));
+        in.read((char*)upper_[i].data(), upper_[i].size() * sizeof(int32_t));
+    }
+    if (!in) {
+        throw std::invalid_argument("Index is truncated!");
+    }
+}
+
+} // namespace word2vec
@@ -0,0 +1,81 @@
+//
+// Created by fengjiaxin on 2023/5/15.
+// HNSW 近似最近邻索引, 建立在归一化之后的词向量上, 相似度是内积
+
+#ifndef WORD2VEC_HNSW_H
+#define WORD2VEC_HNSW_H
+
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include "matrix.h"
+#include "real.h"
+#include "thread_pool.h"
+
+namespace word2vec {
+
+class HnswIndex {
+private:
+    static const int32_t HNSW_MAGIC_INT32 = 793712316;
+    static const int32_t HNSW_VERSION = 1;
+
+    typedef std::pair<real, int32_t> Candidate; // (相似度, 行号)
+
+    const Matrix& vectors_; // 由调用方持有, 生命周期要比索引长
+    int32_t M_;
+    int32_t maxM0_; // 第 0 层允许的最大邻居数, 2 * M
+    int32_t efConstruction_;
+    int32_t maxLevel_;
+    int32_t entryPoint_;
+    std::vector<int32_t> levels_;
+    // 每个节点的邻居表: 第一个数是邻居个数, 后面是邻居
+    std::vector<int32_t> links0_;
+    std::vector<std::vector<int32_t>> upper_;
+
+    const real* row(int32_t) const;
+    real similarity(const real*, int32_t) const;
+    int32_t maxNeighbors(int32_t level) const;
+    int32_t* neighbors(int32_t node, int32_t level);
+    const int32_t* neighbors(int32_t node, int32_t level) const;
+    void copyNeighbors(int32_t node, int32_t level, std::vector<int32_t>&, std::mutex*) const;
+    int32_t greedySearch(const real*, int32_t ep, int32_t top, int32_t bottom, std::mutex*) const;
+    std::vector<Candidate> searchLayer(
+            const real*,
+            int32_t ep,
+            int32_t ef,
+            int32_t level,
+            std::mutex*) const;
+    std::vector<int32_t> selectNeighbors(
+            std::vector<Candidate>& candidates,
+            int32_t m) const;
+    void connect(int32_t node, int32_t level, const std::vector<int32_t>&, std::mutex*);
+    void insert(int32_t node, std::mutex* locks, std::mutex& global);
+
+public:
+    // vectors 的每一行都需要已经归一化
+    HnswIndex(
+            const Matrix& vectors,
+            int32_t M,
+            int32_t efConstruction,
+            int32_t thread,
+            ThreadPool& pool);
+    HnswIndex(const Matrix& vectors, std::istream& in);
+    HnswIndex(const HnswIndex&) = delete;
+    HnswIndex& operator=(const HnswIndex&) = delete;
+
+    // 返回相似度最高的 k 个 (相似度, 行号), ef 越大召回越高, 速度越慢
+    std::vector<std::pair<real, int32_t>> search(
+            const real* query,
+            int32_t k,
+            int32_t ef) const;
+
+    void save(std::ostream&) const;
+    void load(std::istream&);
+};
+
+} // namespace word2vec
+
+#endif //WORD2VEC_HNSW_H
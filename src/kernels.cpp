@@ -0,0 +1,461 @@
+//
+// Created by fengjiaxin on 2023/5/13.
+//
+
+#include "kernels.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define WORD2VEC_X86 1
+#include <immintrin.h>
+#endif
+
+namespace word2vec {
+
+namespace kernels {
+
+namespace {
+
+real dotScalar(const real* x, const real* y, int64_t n) {
+    real d = 0.0;
+    for (int64_t j = 0; j < n; j++) {
+        d += x[j] * y[j];
+    }
+    return d;
+}
+
+void axpyScalar(real a, const real* x, real* y, int64_t n) {
+    for (int64_t j = 0; j < n; j++) {
+        y[j] += a * x[j];
+    }
+}
+
+void addScalar(const real* x, real* y, int64_t n) {
+    for (int64_t j = 0; j < n; j++) {
+        y[j] += x[j];
+    }
+}
+
+void updateScalar(real a, const real* h, real* w, real* g, int64_t n) {
+    for (int64_t j = 0; j < n; j++) {
+        real wj = w[j];
+        g[j] += a * wj;
+        w[j] = wj + a * h[j];
+    }
+}
+
+uint32_t floatBits(float f) {
+    uint32_t u;
+    std::memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+float bitsFloat(uint32_t u) {
+    float f;
+    std::memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+// 按位转换, 处理非规格化数、无穷和 NaN
+real fp16ToFloatOne(uint16_t h) {
+    const uint32_t shiftedExp = 0x7c00u << 13;
+    uint32_t o = uint32_t(h & 0x7fff) << 13;
+    uint32_t exp = shiftedExp & o;
+    o += uint32_t(127 - 15) << 23;
+    if (exp == shiftedExp) {
+        o += uint32_t(128 - 16) << 23;
+    } else if (exp == 0) {
+        o += 1u << 23;
+        o = floatBits(bitsFloat(o) - bitsFloat(113u << 23));
+    }
+    return bitsFloat(o | (uint32_t(h & 0x8000) << 16));
+}
+
+uint16_t floatToFp16One(real x) {
+    const uint32_t infinity = 255u << 23;
+    const uint32_t fp16Max = uint32_t(127 + 16) << 23;
+    const uint32_t denormMagic = uint32_t((127 - 15) + (23 - 10) + 1) << 23;
+    uint32_t f = floatBits(x);
+    uint32_t sign = f & 0x80000000u;
+    f ^= sign;
+    uint16_t o;
+    if (f >= fp16Max) {
+        o = f > infinity ? 0x7e00 : 0x7c00;
+    } else if (f < (113u << 23)) {
+        o = uint16_t(floatBits(bitsFloat(f) + bitsFloat(denormMagic)) - denormMagic);
+    } else {
+        uint32_t mantOdd = (f >> 13) & 1;
+        f += (uint32_t(15 - 127) << 23) + 0xfff + mantOdd;
+        o = uint16_t(f >> 13);
+    }
+    return o | uint16_t(sign >> 16);
+}
+
+uint16_t floatToBf16One(real x) {
+    uint32_t u = floatBits(x);
+    if ((u & 0x7fffffffu) > 0x7f800000u) {
+        return uint16_t((u >> 16) | 0x40);
+    }
+    return uint16_t((u + 0x7fff + ((u >> 16) & 1)) >> 16);
+}
+
+void fp16ToFloatScalar(const uint16_t* x, real* y, int64_t n) {
+    for (int64_t j = 0; j < n; j++) {
+        y[j] = fp16ToFloatOne(x[j]);
+    }
+}
+
+void floatToFp16Scalar(const real* x, uint16_t* y, int64_t n) {
+    for (int64_t j = 0; j < n; j++) {
+        y[j] = floatToFp16One(x[j]);
+    }
+}
+
+void bf16ToFloatScalar(const uint16_t* x, real* y, int64_t n) {
+    for (int64_t j = 0; j < n; j++) {
+        y[j] = bitsFloat(uint32_t(x[j]) << 16);
+    }
+}
+
+void floatToBf16Scalar(const real* x, uint16_t* y, int64_t n) {
+    for (int64_t j = 0; j < n; j++) {
+        y[j] = floatToBf16One(x[j]);
+    }
+}
+
+#ifdef WORD2VEC_X86
+
+// SSE2 是 x86-64 的基线指令集, 不需要检测
+real dotSSE(const real* x, const real* y, int64_t n) {
+    __m128 s0 = _mm_setzero_ps();
+    __m128 s1 = _mm_setzero_ps();
+    int64_t j = 0;
+    for (; j + 8 <= n; j += 8) {
+        s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(x + j), _mm_loadu_ps(y + j)));
+        s1 = _mm_add_ps(
+                s1, _mm_mul_ps(_mm_loadu_ps(x + j + 4), _mm_loadu_ps(y + j + 4)));
+    }
+    for (; j + 4 <= n; j += 4) {
+        s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(x + j), _mm_loadu_ps(y + j)));
+    }
+    s0 = _mm_add_ps(s0, s1);
+    s0 = _mm_add_ps(s0, _mm_movehl_ps(s0, s0));
+    s0 = _mm_add_ss(s0, _mm_shuffle_ps(s0, s0, 1));
+    real d = _mm_cvtss_f32(s0);
+    for (; j < n; j++) {
+        d += x[j] * y[j];
+    }
+    return d;
+}
+
+void axpySSE(real a, const real* x, real* y, int64_t n) {
+    const __m128 va = _mm_set1_ps(a);
+    int64_t j = 0;
+    for (; j + 4 <= n; j += 4) {
+        _mm_storeu_ps(
+                y + j, _mm_add_ps(_mm_loadu_ps(y + j), _mm_mul_ps(va, _mm_loadu_ps(x + j))));
+    }
+    for (; j < n; j++) {
+        y[j] += a * x[j];
+    }
+}
+
+void addSSE(const real* x, real* y, int64_t n) {
+    int64_t j = 0;
+    for (; j + 4 <= n; j += 4) {
+        _mm_storeu_ps(y + j, _mm_add_ps(_mm_loadu_ps(y + j), _mm_loadu_ps(x + j)));
+    }
+    for (; j < n; j++) {
+        y[j] += x[j];
+    }
+}
+
+void updateSSE(real a, const real* h, real* w, real* g, int64_t n) {
+    const __m128 va = _mm_set1_ps(a);
+    int64_t j = 0;
+    for (; j + 4 <= n; j += 4) {
+        __m128 vw = _mm_loadu_ps(w + j);
+        _mm_storeu_ps(g + j, _mm_add_ps(_mm_loadu_ps(g + j), _mm_mul_ps(va, vw)));
+        _mm_storeu_ps(w + j, _mm_add_ps(vw, _mm_mul_ps(va, _mm_loadu_ps(h + j))));
+    }
+    for (; j < n; j++) {
+        real wj = w[j];
+        g[j] += a * wj;
+        w[j] = wj + a * h[j];
+    }
+}
+
+__attribute__((target("avx2,fma")))
+real dotAVX2(const real* x, const real* y, int64_t n) {
+    __m256 s0 = _mm256_setzero_ps();
+    __m256 s1 = _mm256_setzero_ps();
+    int64_t j = 0;
+    for (; j + 16 <= n; j += 16) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + j), _mm256_loadu_ps(y + j), s0);
+        s1 = _mm256_fmadd_ps(
+                _mm256_loadu_ps(x + j + 8), _mm256_loadu_ps(y + j + 8), s1);
+    }
+    for (; j + 8 <= n; j += 8) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + j), _mm256_loadu_ps(y + j), s0);
+    }
+    s0 = _mm256_add_ps(s0, s1);
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(s0), _mm256_extractf128_ps(s0, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    real d = _mm_cvtss_f32(s);
+    for (; j < n; j++) {
+        d += x[j] * y[j];
+    }
+    return d;
+}
+
+__attribute__((target("avx2,fma")))
+void axpyAVX2(real a, const real* x, real* y, int64_t n) {
+    const __m256 va = _mm256_set1_ps(a);
+    int64_t j = 0;
+    for (; j + 8 <= n; j += 8) {
+        _mm256_storeu_ps(
+                y + j, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + j), _mm256_loadu_ps(y + j)));
+    }
+    for (; j < n; j++) {
+        y[j] += a * x[j];
+    }
+}
+
+__attribute__((target("avx2")))
+void addAVX2(const real* x, real* y, int64_t n) {
+    int64_t j = 0;
+    for (; j + 8 <= n; j += 8) {
+        _mm256_storeu_ps(
+                y + j, _mm256_add_ps(_mm256_loadu_ps(y + j), _mm256_loadu_ps(x + j)));
+    }
+    for (; j < n; j++) {
+        y[j] += x[j];
+    }
+}
+
+__attribute__((target("avx2,fma")))
+void updateAVX2(real a, const real* h, real* w, real* g, int64_t n) {
+    const __m256 va = _mm256_set1_ps(a);
+    int64_t j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m256 vw = _mm256_loadu_ps(w + j);
+        _mm256_storeu_ps(g + j, _mm256_fmadd_ps(va, vw, _mm256_loadu_ps(g + j)));
+        _mm256_storeu_ps(w + j, _mm256_fmadd_ps(va, _mm256_loadu_ps(h + j), vw));
+    }
+    for (; j < n; j++) {
+        real wj = w[j];
+        g[j] += a * wj;
+        w[j] = wj + a * h[j];
+    }
+}
+
+__attribute__((target("avx2,f16c")))
+void fp16ToFloatAVX2(const uint16_t* x, real* y, int64_t n) {
+    int64_t j = 0;
+    for (; j + 8 <= n; j += 8) {
+        _mm256_storeu_ps(y + j, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(x + j))));
+    }
+    fp16ToFloatScalar(x + j, y + j, n - j);
+}
+
+__attribute__((target("avx2,f16c")))
+void floatToFp16AVX2(const real* x, uint16_t* y, int64_t n) {
+    int64_t j = 0;
+    for (; j + 8 <= n; j += 8) {
+        _mm_storeu_si128(
+                (__m128i*)(y + j),
+                _mm256_cvtps_ph(_mm256_loadu_ps(x + j), _MM_FROUND_TO_NEAREST_INT));
+    }
+    floatToFp16Scalar(x + j, y + j, n - j);
+}
+
+__attribute__((target("avx2")))
+void bf16ToFloatAVX2(const uint16_t* x, real* y, int64_t n) {
+    int64_t j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(x + j)));
+        _mm256_storeu_ps(y + j, _mm256_castsi256_ps(_mm256_slli_epi32(v, 16)));
+    }
+    bf16ToFloatScalar(x + j, y + j, n - j);
+}
+
+// 向量版本不单独处理 NaN, NaN 在 dotRow 里会被发现
+__attribute__((target("avx2")))
+void floatToBf16AVX2(const real* x, uint16_t* y, int64_t n) {
+    const __m256i bias = _mm256_set1_epi32(0x7fff);
+    const __m256i one = _mm256_set1_epi32(1);
+    int64_t j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m256i v = _mm256_castps_si256(_mm256_loadu_ps(x + j));
+        __m256i odd = _mm256_and_si256(_mm256_srli_epi32(v, 16), one);
+        v = _mm256_srli_epi32(_mm256_add_epi32(v, _mm256_add_epi32(bias, odd)), 16);
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0x08);
+        _mm_storeu_si128((__m128i*)(y + j), _mm256_castsi256_si128(packed));
+    }
+    floatToBf16Scalar(x + j, y + j, n - j);
+}
+
+// AVX-512 用 mask 处理尾部, 不需要标量循环
+__attribute__((target("avx512f")))
+real dotAVX512(const real* x, const real* y, int64_t n) {
+    __m512 s0 = _mm512_setzero_ps();
+    __m512 s1 = _mm512_setzero_ps();
+    int64_t j = 0;
+    for (; j + 32 <= n; j += 32) {
+        s0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + j), _mm512_loadu_ps(y + j), s0);
+        s1 = _mm512_fmadd_ps(
+                _mm512_loadu_ps(x + j + 16), _mm512_loadu_ps(y + j + 16), s1);
+    }
+    for (; j + 16 <= n; j += 16) {
+        s0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + j), _mm512_loadu_ps(y + j), s0);
+    }
+    if (j < n) {
+        __mmask16 m = (__mmask16)((1u << (n - j)) - 1);
+        s1 = _mm512_fmadd_ps(
+                _mm512_maskz_loadu_ps(m, x + j), _mm512_maskz_loadu_ps(m, y + j), s1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(s0, s1));
+}
+
+__attribute__((target("avx512f")))
+void axpyAVX512(real a, const real* x, real* y, int64_t n) {
+    const __m512 va = _mm512_set1_ps(a);
+    int64_t j = 0;
+    for (; j + 16 <= n; j += 16) {
+        _mm512_storeu_ps(
+                y + j, _mm512_fmadd_ps(va, _mm512_loadu_ps(x + j), _mm512_loadu_ps(y + j)));
+    }
+    if (j < n) {
+        __mmask16 m = (__mmask16)((1u << (n - j)) - 1);
+        _mm512_mask_storeu_ps(
+                y + j,
+                m,
+                _mm512_fmadd_ps(
+                        va, _mm512_maskz_loadu_ps(m, x + j), _mm512_maskz_loadu_ps(m, y + j)));
+    }
+}
+
+__attribute__((target("avx512f")))
+void addAVX512(const real* x, real* y, int64_t n) {
+    int64_t j = 0;
+    for (; j + 16 <= n; j += 16) {
+        _mm512_storeu_ps(
+                y + j, _mm512_add_ps(_mm512_loadu_ps(y + j), _mm512_loadu_ps(x + j)));
+    }
+    if (j < n) {
+        __mmask16 m = (__mmask16)((1u << (n - j)) - 1);
+        _mm512_mask_storeu_ps(
+                y + j,
+                m,
+                _mm512_add_ps(_mm512_maskz_loadu_ps(m, y + j), _mm512_maskz_loadu_ps(m, x + j)));
+    }
+}
+
+__attribute__((target("avx512f")))
+void updateAVX512(real a, const real* h, real* w, real* g, int64_t n) {
+    const __m512 va = _mm512_set1_ps(a);
+    int64_t j = 0;
+    for (; j + 16 <= n; j += 16) {
+        __m512 vw = _mm512_loadu_ps(w + j);
+        _mm512_storeu_ps(g + j, _mm512_fmadd_ps(va, vw, _mm512_loadu_ps(g + j)));
+        _mm512_storeu_ps(w + j, _mm512_fmadd_ps(va, _mm512_loadu_ps(h + j), vw));
+    }
+    if (j < n) {
+        __mmask16 m = (__mmask16)((1u << (n - j)) - 1);
+        __m512 vw = _mm512_maskz_loadu_ps(m, w + j);
+        _mm512_mask_storeu_ps(
+                g + j, m, _mm512_fmadd_ps(va, vw, _mm512_maskz_loadu_ps(m, g + j)));
+        _mm512_mask_storeu_ps(
+                w + j, m, _mm512_fmadd_ps(va, _mm512_maskz_loadu_ps(m, h + j), vw));
+    }
+}
+
+__attribute__((target("avx512f")))
+void fp16ToFloatAVX512(const uint16_t* x, real* y, int64_t n) {
+    int64_t j = 0;
+    for (; j + 16 <= n; j += 16) {
+        _mm512_storeu_ps(y + j, _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(x + j))));
+    }
+    fp16ToFloatScalar(x + j, y + j, n - j);
+}
+
+__attribute__((target("avx512f")))
+void floatToFp16AVX512(const real* x, uint16_t* y, int64_t n) {
+    int64_t j = 0;
+    for (; j + 16 <= n; j += 16) {
+        _mm256_storeu_si256(
+                (__m256i*)(y + j),
+                _mm512_cvtps_ph(
+                        _mm512_loadu_ps(x + j), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+    }
+    floatToFp16Scalar(x + j, y + j, n - j);
+}
+
+__attribute__((target("avx512f")))
+void bf16ToFloatAVX512(const uint16_t* x, real* y, int64_t n) {
+    int64_t j = 0;
+    for (; j + 16 <= n; j += 16) {
+        __m512i v = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(x + j)));
+        _mm512_storeu_ps(y + j, _mm512_castsi512_ps(_mm512_slli_epi32(v, 16)));
+    }
+    bf16ToFloatScalar(x + j, y + j, n - j);
+}
+
+__attribute__((target("avx512f")))
+void floatToBf16AVX512(const real* x, uint16_t* y, int64_t n) {
+    const __m512i bias = _mm512_set1_epi32(0x7fff);
+    const __m512i one = _mm512_set1_epi32(1);
+    int64_t j = 0;
+    for (; j + 16 <= n; j += 16) {
+        __m512i v = _mm512_castps_si512(_mm512_loadu_ps(x + j));
+        __m512i odd = _mm512_and_si512(_mm512_srli_epi32(v, 16), one);
+        v = _mm512_srli_epi32(_mm512_add_epi32(v, _mm512_add_epi32(bias, odd)), 16);
+        _mm256_storeu_si256((__m256i*)(y + j), _mm512_cvtepi32_epi16(v));
+    }
+    floatToBf16Scalar(x + j, y + j, n - j);
+}
+
+#endif // WORD2VEC_X86
+
+std::vector<KernelTable> detect() {
+    std::vector<KernelTable> tables;
+    tables.push_back({"scalar", dotScalar, axpyScalar, addScalar, updateScalar,
+                      fp16ToFloatScalar, floatToFp16Scalar,
+                      bf16ToFloatScalar, floatToBf16Scalar});
+#ifdef WORD2VEC_X86
+    __builtin_cpu_init();
+    tables.push_back({"sse", dotSSE, axpySSE, addSSE, updateSSE,
+                      fp16ToFloatScalar, floatToFp16Scalar,
+                      bf16ToFloatScalar, floatToBf16Scalar});
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+        __builtin_cpu_supports("f16c")) {
+        tables.push_back({"avx2", dotAVX2, axpyAVX2, addAVX2, updateAVX2,
+                          fp16ToFloatAVX2, floatToFp16AVX2,
+                          bf16ToFloatAVX2, floatToBf16AVX2});
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        tables.push_back({"avx512", dotAVX512, axpyAVX512, addAVX512, updateAVX512,
+                          fp16ToFloatAVX512, floatToFp16AVX512,
+                          bf16ToFloatAVX512, floatToBf16AVX512});
+    }
+#endif
+    return tables;
+}
+
+} // namespace
+
+const std::vector<KernelTable>& available() {
+    static const std::vector<KernelTable> tables = detect();
+    return tables;
+}
+
+const KernelTable& active() {
+    static const KernelTable table = available().back();
+    return table;
+}
+
+} // namespace kernels
+
+} // namespace word2vec
@@ -0,0 +1,73 @@
+//
+// Created by fengjiaxin on 2023/5/13.
+// 训练最内层的向量运算, 运行时根据 CPU 选择 AVX-512/AVX2/SSE/标量实现
+
+#ifndef WORD2VEC_KERNELS_H
+#define WORD2VEC_KERNELS_H
+
+#include <cstdint>
+#include <vector>
+
+#include "real.h"
+
+namespace word2vec {
+
+namespace kernels {
+
+struct KernelTable {
+    const char* name;
+    real (*dot)(const real* x, const real* y, int64_t n);
+    void (*axpy)(real a, const real* x, real* y, int64_t n); // y += a * x
+    void (*add)(const real* x, real* y, int64_t n); // y += x
+    // g += a * w; w += a * h, 负采样里对同一行的两次更新合成一遍
+    void (*update)(real a, const real* h, real* w, real* g, int64_t n);
+    // 半精度和 real 之间的转换, 写回时就近舍入到偶数
+    void (*fp16ToFloat)(const uint16_t* x, real* y, int64_t n);
+    void (*floatToFp16)(const real* x, uint16_t* y, int64_t n);
+    void (*bf16ToFloat)(const uint16_t* x, real* y, int64_t n);
+    void (*floatToBf16)(const real* x, uint16_t* y, int64_t n);
+};
+
+// 当前 CPU 支持的所有实现, 第一个是标量版本
+const std::vector<KernelTable>& available();
+
+// 启动时选出的最快实现
+const KernelTable& active();
+
+inline real dot(const real* x, const real* y, int64_t n) {
+    return active().dot(x, y, n);
+}
+
+inline void axpy(real a, const real* x, real* y, int64_t n) {
+    active().axpy(a, x, y, n);
+}
+
+inline void add(const real* x, real* y, int64_t n) {
+    active().add(x, y, n);
+}
+
+inline void update(real a, const real* h, real* w, real* g, int64_t n) {
+    active().update(a, h, w, g, n);
+}
+
+inline void toFloat(dtype_name dtype, const uint16_t* x, real* y, int64_t n) {
+    if (dtype == dtype_name::fp16) {
+        active().fp16ToFloat(x, y, n);
+    } else {
+        active().bf16ToFloat(x, y, n);
+    }
+}
+
+inline void fromFloat(dtype_name dtype, const real* x, uint16_t* y, int64_t n) {
+    if (dtype == dtype_name::fp16) {
+        active().floatToFp16(x, y, n);
+    } else {
+        active().floatToBf16(x, y, n);
+    }
+}
+
+} // namespace kernels
+
+} // namespace word2vec
+
+#endif //WORD2VEC_KERNELS_H
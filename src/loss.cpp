@@ -6,8 +6,15 @@
 #include "utils.h"
 #include "math_helper.h"
 
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+
 namespace word2vec {
 
+const int64_t SAMPLE_PROFILE_RATE = 16;
+
 bool comparePairs(
         const std::pair<real, int32_t>& l,
         const std::pair<real, int32_t>& r) {
@@ -60,8 +67,7 @@ real BinaryLogisticLoss::binaryLogistic(
     real score = ml_sigmoid(wo_->dotRow(state.hidden, target));
     if (backprop) {
         real alpha = lr * (real(isPositive) - score);
-        state.grad.addRow(*wo_, target, alpha);
-        wo_->addVectorToRow(state.hidden, target, alpha);
+        wo_->updateRow(state.hidden, state.grad, target, alpha);
     }
     if (isPositive) {
         return -ml_log(score);
@@ -99,23 +105,158 @@ real NegativeSamplingLoss::forward(
     int32_t target = targets[targetIndex];
     real loss = binaryLogistic(target, state, true, lr, backprop);
 
+    // 先把负样本全部抽出来, 抽样的顺序不变, 计时只需要一次
+    // 读时钟比抽样本身还贵, 只对 1/SAMPLE_PROFILE_RATE 的调用计时, 再按比例放大
+    bool timed = state.profile && (++state.profileTick % SAMPLE_PROFILE_RATE) == 0;
+    std::chrono::steady_clock::time_point start;
+    if (timed) {
+        start = std::chrono::steady_clock::now();
+    }
+    state.negatives.resize(neg_);
     for (int32_t n = 0; n < neg_; n++) {
-        int32_t negativeTarget = getNegative(target);
-        loss += binaryLogistic(negativeTarget, state, false, lr, backprop);
+        state.negatives[n] = getNegative(target, state.rng);
+    }
+    if (timed) {
+        state.sampleNanos += SAMPLE_PROFILE_RATE *
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count();
+    }
+    for (int32_t n = 0; n < neg_; n++) {
+        loss += binaryLogistic(state.negatives[n], state, false, lr, backprop);
     }
     return loss;
 }
 
 int32_t NegativeSamplingLoss::getNegative(
-        int32_t target) {
+        int32_t target,
+        XorShiftRng& rng) const {
     int32_t negative;
     do {
-        negative = aliasSample.Next();
+        negative = aliasSample.Next(rng);
     } while (target == negative);
     return negative;
 }
 
 
 
+HierarchicalSoftmaxLoss::HierarchicalSoftmaxLoss(
+        std::shared_ptr<Matrix>& wo,
+        const std::vector<int32_t>& counts)
+        : BinaryLogisticLoss(wo), osz_(counts.size()) {
+    buildTree(counts);
+}
+
+// 叶子 i 就是第 i 个词; 合并时按 order 里词频从大到小的顺序取叶子,
+// 增量训练扩展词典之后 counts 不再有序, 这里不依赖词典的排列
+void HierarchicalSoftmaxLoss::buildTree(const std::vector<int32_t>& counts) {
+    std::vector<int32_t> order(osz_);
+    for (int32_t i = 0; i < osz_; i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&counts](int32_t a, int32_t b) {
+        return counts[a] > counts[b];
+    });
+    tree_.resize(2 * osz_ - 1);
+    for (int32_t i = 0; i < 2 * osz_ - 1; i++) {
+        tree_[i].parent = -1;
+        tree_[i].left = -1;
+        tree_[i].right = -1;
+        tree_[i].count = 1e15;
+        tree_[i].binary = false;
+    }
+    for (int32_t i = 0; i < osz_; i++) {
+        tree_[i].count = counts[i];
+    }
+    int32_t leaf = osz_ - 1;
+    int32_t node = osz_;
+    for (int32_t i = osz_; i < 2 * osz_ - 1; i++) {
+        int32_t mini[2] = {0};
+        for (int32_t j = 0; j < 2; j++) {
+            if (leaf >= 0 && tree_[order[leaf]].count < tree_[node].count) {
+                mini[j] = order[leaf--];
+            } else {
+                mini[j] = node++;
+            }
+        }
+        tree_[i].left = mini[0];
+        tree_[i].right = mini[1];
+        tree_[i].count = tree_[mini[0]].count + tree_[mini[1]].count;
+        tree_[mini[0]].parent = i;
+        tree_[mini[1]].parent = i;
+        tree_[mini[1]].binary = true;
+    }
+
+    // 内部节点 i 对应 output 矩阵的第 i - osz_ 行
+    offsets_.assign(1, 0);
+    for (int32_t i = 0; i < osz_; i++) {
+        int32_t j = i;
+        while (tree_[j].parent != -1) {
+            paths_.push_back(tree_[j].parent - osz_);
+            codes_.push_back(tree_[j].binary);
+            j = tree_[j].parent;
+        }
+        offsets_.push_back(paths_.size());
+    }
+    paths_.shrink_to_fit();
+    codes_.shrink_to_fit();
+}
+
+real HierarchicalSoftmaxLoss::forward(
+        const std::vector<int32_t>& targets,
+        int32_t targetIndex,
+        Model::State& state,
+        real lr,
+        bool backprop) {
+    assert(targetIndex >= 0);
+    assert(targetIndex < targets.size());
+    real loss = 0.0;
+    int32_t target = targets[targetIndex];
+    for (int32_t i = offsets_[target]; i < offsets_[target + 1]; i++) {
+        loss += binaryLogistic(paths_[i], state, codes_[i], lr, backprop);
+    }
+    return loss;
+}
+
+void HierarchicalSoftmaxLoss::predict(
+        int32_t k,
+        real threshold,
+        Predictions& heap,
+        Model::State& state) const {
+    dfs(k, threshold, 2 * osz_ - 2, 0.0, heap, state.hidden);
+    std::sort_heap(heap.begin(), heap.end(), comparePairs);
+}
+
+// 沿着树往下搜索, 概率已经小于阈值或者不可能进入 top k 的子树直接剪掉
+void HierarchicalSoftmaxLoss::dfs(
+        int32_t k,
+        real threshold,
+        int32_t node,
+        real score,
+        Predictions& heap,
+        const Vector& hidden) const {
+    if (score < std::log(threshold + 1e-5)) {
+        return;
+    }
+    if (heap.size() == k && score < heap.front().first) {
+        return;
+    }
+
+    if (tree_[node].left == -1 && tree_[node].right == -1) {
+        heap.push_back(std::make_pair(score, node));
+        std::push_heap(heap.begin(), heap.end(), comparePairs);
+        if (heap.size() > k) {
+            std::pop_heap(heap.begin(), heap.end(), comparePairs);
+            heap.pop_back();
+        }
+        return;
+    }
+
+    real f = ml_sigmoid(wo_->dotRow(hidden, node - osz_));
+    dfs(k, threshold, tree_[node].left, score + std::log(1.0 - f + 1e-5), heap, hidden);
+    dfs(k, threshold, tree_[node].right, score + std::log(f + 1e-5), heap, hidden);
+}
+
+
+
 
 } // namespace word2vec
@@ -71,7 +71,7 @@ class NegativeSamplingLoss : public BinaryLogisticLoss {
 protected:
     int neg_;
     AliasSample aliasSample;
-    int32_t getNegative(int32_t target);
+    int32_t getNegative(int32_t target, XorShiftRng& rng) const;
 
 public:
     explicit NegativeSamplingLoss(
@@ -89,6 +89,52 @@ public:
             bool backprop) override;
 };
 
+// 根据词频构建 Huffman 树, 每个词的损失只和根到叶子路径上的 O(log V) 个内部节点有关
+class HierarchicalSoftmaxLoss : public BinaryLogisticLoss {
+protected:
+    struct Node {
+        int32_t parent;
+        int32_t left;
+        int32_t right;
+        int64_t count;
+        bool binary;
+    };
+
+    // 所有词的路径和编码拼在一起存, 第 i 个词的范围是 [offsets_[i], offsets_[i + 1])
+    std::vector<int32_t> offsets_;
+    std::vector<int32_t> paths_;
+    std::vector<uint8_t> codes_;
+    std::vector<Node> tree_;
+    int32_t osz_;
+    void buildTree(const std::vector<int32_t>& counts);
+    void dfs(
+            int32_t k,
+            real threshold,
+            int32_t node,
+            real score,
+            Predictions& heap,
+            const Vector& hidden) const;
+
+public:
+    explicit HierarchicalSoftmaxLoss(
+            std::shared_ptr<Matrix>& wo,
+            const std::vector<int32_t>& counts);
+    ~HierarchicalSoftmaxLoss() noexcept override = default;
+
+    real forward(
+            const std::vector<int32_t>& targets,
+            int32_t targetIndex,
+            Model::State& state,
+            real lr,
+            bool backprop) override;
+
+    void predict(
+            int32_t k,
+            real threshold,
+            Predictions& heap,
+            Model::State& state) const override;
+};
+
 } // namespace word2vec
 
 
@@ -3,9 +3,11 @@
 //
 
 
+#include <cstdio>
 #include <iostream>
 #include <queue>
 #include <stdexcept>
+#include <thread>
 #include "args.h"
 #include "word2vec.h"
 
@@ -17,8 +19,13 @@ void printUsage() {
             << "The commands supported by word2vec are:\n\n"
             << "  skipgram                train a skipgram model\n"
             << "  cbow                    train a cbow model\n"
+            << "  encode                  convert a text corpus into word ids for training\n"
             << "  print-word-vectors      print word vectors given a trained model\n"
             << "  nn                      query for nearest neighbors\n"
+            << "  nn-all                  compute nearest neighbors for the whole vocabulary\n"
+            << "  index                   build an approximate nearest neighbor index\n"
+            << "  quantize                compress the input vectors with product quantization\n"
+            << "  precompute              store normalized word vectors in the model for fast loading\n"
             << "  dump                    dump arguments,dictionary,input/output vectors\n"
             << std::endl;
 }
@@ -33,13 +40,35 @@ void printPrintWordVectorsUsage() {
 
 
 void printNNUsage() {
-    std::cout << "usage: word2vec nn <model> <k>\n\n"
+    std::cout << "usage: word2vec nn <model> <k> <ef>\n\n"
               << "  <model>      model filename\n"
               << "  <k>          (optional; 10 by default) predict top k words\n"
+              << "  <ef>         (optional; 64 by default) search width when <model>.hnsw exists\n"
               << std::endl;
 }
 
+void printNNAllUsage() {
+    std::cout << "usage: word2vec nn-all <model> <k> <thread>\n\n"
+              << "  <model>      model filename\n"
+              << "  <k>          (optional; 10 by default) neighbors per word\n"
+              << "  <thread>     (optional; all cores by default) number of threads\n"
+              << std::endl;
+}
 
+void printIndexUsage() {
+    std::cout << "usage: word2vec index <model> <M> <efConstruction>\n\n"
+              << "  <model>            model filename, the index is saved to <model>.hnsw\n"
+              << "  <M>                (optional; 16 by default) neighbors per node\n"
+              << "  <efConstruction>   (optional; 200 by default) search width while building\n"
+              << std::endl;
+}
+
+void printPrecomputeUsage() {
+    std::cout << "usage: word2vec precompute <model> <thread>\n\n"
+              << "  <model>      model filename, rewritten in place with the normalized vectors\n"
+              << "  <thread>     (optional; all cores by default) number of threads\n"
+              << std::endl;
+}
 
 void printDumpUsage() {
     std::cout << "usage: word2vec dump <model> <option>\n\n"
@@ -86,32 +115,108 @@ void printPredictions(
 
 
 void nn(const std::vector<std::string> args) {
-    int32_t k;
-    if (args.size() == 3) {
-        k = 10;
-    } else if (args.size() == 4) {
-        k = std::stoi(args[3]);
-    } else {
+    int32_t k = 10;
+    int32_t ef = 64;
+    if (args.size() < 3 || args.size() > 5) {
         printNNUsage();
         exit(EXIT_FAILURE);
     }
+    if (args.size() >= 4) {
+        k = std::stoi(args[3]);
+    }
+    if (args.size() == 5) {
+        ef = std::stoi(args[4]);
+    }
+    if (k <= 0) {
+        std::cerr << "k needs to be 1 or higher!" << std::endl;
+        exit(EXIT_FAILURE);
+    }
     Word2Vec word2Vec;
     word2Vec.loadModel(std::string(args[2]));
+    std::string indexFileName = args[2] + ".hnsw";
+    if (std::ifstream(indexFileName).good()) {
+        std::cerr << "Loading index " << indexFileName << std::endl;
+        word2Vec.loadIndex(indexFileName);
+    }
     std::string prompt("Query word? ");
     std::cout << prompt;
 
     std::string queryWord;
     while (std::cin >> queryWord) {
-        printPredictions(word2Vec.getNN(queryWord, k));
+        printPredictions(word2Vec.getNN(queryWord, k, ef));
         std::cout << prompt;
     }
     exit(0);
 }
 
+void nnAll(const std::vector<std::string> args) {
+    int32_t k = 10;
+    int32_t thread = std::thread::hardware_concurrency();
+    if (args.size() < 3 || args.size() > 5) {
+        printNNAllUsage();
+        exit(EXIT_FAILURE);
+    }
+    if (args.size() >= 4) {
+        k = std::stoi(args[3]);
+    }
+    if (args.size() == 5) {
+        thread = std::stoi(args[4]);
+    }
+    if (k <= 0) {
+        std::cerr << "k needs to be 1 or higher!" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    Word2Vec word2Vec;
+    word2Vec.loadModel(std::string(args[2]));
+    word2Vec.saveNN(std::cout, k, thread);
+}
+
+void indexModel(const std::vector<std::string> args) {
+    int32_t M = 16;
+    int32_t efConstruction = 200;
+    if (args.size() < 3 || args.size() > 5) {
+        printIndexUsage();
+        exit(EXIT_FAILURE);
+    }
+    if (args.size() >= 4) {
+        M = std::stoi(args[3]);
+    }
+    if (args.size() == 5) {
+        efConstruction = std::stoi(args[4]);
+    }
+    Word2Vec word2Vec;
+    word2Vec.loadModel(std::string(args[2]));
+    word2Vec.buildIndex(M, efConstruction, std::thread::hardware_concurrency());
+    word2Vec.saveIndex(args[2] + ".hnsw");
+}
+
+void precompute(const std::vector<std::string> args) {
+    int32_t thread = std::thread::hardware_concurrency();
+    if (args.size() < 3 || args.size() > 4) {
+        printPrecomputeUsage();
+        exit(EXIT_FAILURE);
+    }
+    if (args.size() == 4) {
+        thread = std::stoi(args[3]);
+    }
+    Word2Vec word2Vec;
+    word2Vec.loadModel(std::string(args[2]));
+    if (word2Vec.isQuant()) {
+        std::cerr << "Quantized model has no dense matrices." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    word2Vec.saveModel(std::string(args[2]), true, thread);
+}
+
 void train(const std::vector<std::string> args) {
     Args a ;
     a.parseArgs(args);
     std::shared_ptr<Word2Vec> word2Vec = std::make_shared<Word2Vec>();
+    if (a.rank > 0) {
+        // 多进程训练时只有 rank 0 写模型
+        word2Vec->train(a);
+        return;
+    }
     std::string outputFileName;
     outputFileName = a.output + ".bin";
 
@@ -122,13 +227,31 @@ void train(const std::vector<std::string> args) {
     }
     ofs.close();
     word2Vec->train(a);
-    word2Vec->saveModel(outputFileName);
+    word2Vec->saveModel(outputFileName, a.saveNormalized, a.thread);
+    // 模型已经写完, 留着 checkpoint 的话下次 -resume 会从旧进度重新训练并覆盖模型
+    std::remove((a.output + ".ckpt").c_str());
     word2Vec->saveVectors(a.output + ".vec");
     if (a.saveOutput) {
         word2Vec->saveOutput(a.output + ".output");
     }
 }
 
+void quantize(const std::vector<std::string> args) {
+    Args a;
+    a.parseArgs(args);
+    Word2Vec word2Vec;
+    word2Vec.loadModel(a.input);
+    word2Vec.quantize(a);
+    word2Vec.saveModel(a.output + ".qbin");
+}
+
+void encode(const std::vector<std::string> args) {
+    Args a;
+    a.parseArgs(args);
+    Word2Vec word2Vec;
+    word2Vec.encode(a);
+}
+
 void dump(const std::vector<std::string>& args) {
     if (args.size() < 4) {
         printDumpUsage();
@@ -144,6 +267,9 @@ void dump(const std::vector<std::string>& args) {
         word2Vec.getArgs().dump(std::cout);
     } else if (option == "dict") {
         word2Vec.getDictionary()->dump(std::cout);
+    } else if ((option == "input" || option == "output") && word2Vec.isQuant()) {
+        std::cerr << "Quantized model has no dense matrices." << std::endl;
+        exit(EXIT_FAILURE);
     } else if (option == "input") {
         word2Vec.getInputMatrix()->dump(std::cout);
     } else if (option == "output") {
@@ -163,10 +289,20 @@ int main(int argc, char** argv) {
     std::string command(args[1]);
     if (command == "skipgram" || command == "cbow") {
         train(args);
+    } else if (command == "encode") {
+        encode(args);
     } else if (command == "print-word-vectors") {
         printWordVectors(args);
     } else if (command == "nn") {
         nn(args);
+    } else if (command == "nn-all") {
+        nnAll(args);
+    } else if (command == "index") {
+        indexModel(args);
+    } else if (command == "quantize") {
+        quantize(args);
+    } else if (command == "precompute") {
+        precompute(args);
     } else if (command == "dump") {
         dump(args);
     } else {
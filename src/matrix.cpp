@@ -4,24 +4,114 @@
 
 #include "matrix.h"
 #include "vector.h"
-#include <thread>
-#include <random>
+#include "kernels.h"
+#include "numa.h"
+#include "rng.h"
+#include "utils.h"
 #include <cassert>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
 
 namespace word2vec {
 
 
-Matrix::Matrix() : m_(0), n_(0) {}
+Matrix::Matrix()
+        : m_(0), n_(0), stride_(0), dtype_(dtype_name::fp32), data_(nullptr), half_(nullptr) {}
 
-Matrix::Matrix(int64_t m, int64_t n) : m_(m), n_(n), data_(m * n) {}
+Matrix::Matrix(int64_t m, int64_t n)
+        : m_(m), n_(n), stride_(n), dtype_(dtype_name::fp32) {
+    allocate(false);
+    zero();
+}
+
+Matrix::Matrix(int64_t m, int64_t n, bool alignRows, bool hugePages, dtype_name dtype)
+        : m_(m), n_(n), stride_(n), dtype_(dtype) {
+    if (alignRows) {
+        const int64_t lineSize = 64 / elementSize();
+        stride_ = (n + lineSize - 1) / lineSize * lineSize;
+    }
+    allocate(hugePages);
+    zero();
+}
 
 Matrix::Matrix(int64_t m, int64_t n, real* dataPtr)
-        : m_(m), n_(n), data_(dataPtr, dataPtr + (m * n)) {}
+        : m_(m), n_(n), stride_(n), dtype_(dtype_name::fp32) {
+    allocate(false);
+    std::copy(dataPtr, dataPtr + m * n, data_);
+}
+
+Matrix::Matrix(int64_t m, int64_t n, real* dataPtr, std::shared_ptr<void> owner)
+        : m_(m),
+          n_(n),
+          stride_(n),
+          dtype_(dtype_name::fp32),
+          data_(dataPtr),
+          half_(nullptr),
+          owner_(std::move(owner)) {}
+
+Matrix::Matrix(
+        int64_t m,
+        int64_t n,
+        uint16_t* dataPtr,
+        dtype_name dtype,
+        std::shared_ptr<void> owner)
+        : m_(m),
+          n_(n),
+          stride_(n),
+          dtype_(dtype),
+          data_(nullptr),
+          half_(dataPtr),
+          owner_(std::move(owner)) {
+    assert(dtype != dtype_name::fp32);
+}
+
+// 拷贝总是得到一份自己持有的数据, 行的布局和精度不变
+Matrix::Matrix(const Matrix& other)
+        : m_(other.m_), n_(other.n_), stride_(other.stride_), dtype_(other.dtype_) {
+    allocate(false);
+    const char* src = other.data_ ? (const char*)other.data_ : (const char*)other.half_;
+    std::copy(src, src + m_ * stride_ * elementSize(), (char*)storage_.get());
+}
 
 Matrix::Matrix(Matrix&& other) noexcept
-        : m_(other.m_), n_(other.n_), data_(std::move(other.data_)) {}
+        : m_(other.m_),
+          n_(other.n_),
+          stride_(other.stride_),
+          dtype_(other.dtype_),
+          storage_(std::move(other.storage_)),
+          data_(other.data_),
+          half_(other.half_),
+          owner_(std::move(other.owner_)) {
+    other.m_ = 0;
+    other.n_ = 0;
+    other.stride_ = 0;
+    other.data_ = nullptr;
+    other.half_ = nullptr;
+}
 
+void Matrix::allocate(bool hugePages) {
+    owner_.reset();
+    storage_ = utils::allocAligned(m_ * stride_ * elementSize(), hugePages);
+    data_ = nullptr;
+    half_ = nullptr;
+    if (dtype_ == dtype_name::fp32) {
+        data_ = static_cast<real*>(storage_.get());
+    } else {
+        half_ = static_cast<uint16_t*>(storage_.get());
+    }
+}
 
+// 半精度矩阵的行运算分块转换, 每块在栈上用 real 计算
+const int64_t HALF_CHUNK = 256;
+
+void Matrix::loadRow(int64_t i, int64_t begin, int64_t n, real* buffer) const {
+    kernels::toFloat(dtype_, half_ + i * stride_ + begin, buffer, n);
+}
+
+void Matrix::storeRow(int64_t i, int64_t begin, int64_t n, const real* buffer) {
+    kernels::fromFloat(dtype_, buffer, half_ + i * stride_ + begin, n);
+}
 
 int64_t Matrix::size(int64_t dim) const {
     assert(dim == 0 || dim == 1);
@@ -33,43 +123,84 @@ int64_t Matrix::size(int64_t dim) const {
 
 
 void Matrix::zero() {
-    std::fill(data_.begin(), data_.end(), 0.0);
+    // 0.0 在三种精度下都是全 0
+    std::memset(data_ ? (void*)data_ : (void*)half_, 0, m_ * stride_ * elementSize());
 }
 
-void Matrix::uniformThread(real a, int block, int32_t seed) {
-    std::minstd_rand rng(block + seed);
-    std::uniform_real_distribution<> uniform(-a, a);
-    int64_t blockSize = (m_ * n_) / 10;
-    for (int64_t i = blockSize * block;
-         i < (m_ * n_) && i < blockSize * (block + 1);
-         i++) {
-        data_[i] = uniform(rng);
-    }
+void Matrix::resizeRows(int64_t m, bool hugePages) {
+    std::shared_ptr<void> storage = storage_;
+    std::shared_ptr<void> owner = owner_;
+    const char* old = data_ ? (const char*)data_ : (const char*)half_;
+    int64_t rows = std::min(m, m_);
+    m_ = m;
+    allocate(hugePages);
+    zero();
+    std::copy(old, old + rows * stride_ * elementSize(), (char*)storage_.get());
 }
 
-void Matrix::uniform(real a, unsigned int thread, int32_t seed) {
-    if (thread > 1) {
-        std::vector<std::thread> threads;
-        for (int i = 0; i < thread; i++) {
-            threads.emplace_back([=]() { uniformThread(a, i, seed); });
+void Matrix::distribute(const NumaTopology& topology, bool interleave) {
+    if (!storage_ || topology.nodes() < 2) {
+        return;
+    }
+    char* base = (char*)storage_.get();
+    const int64_t rowBytes = stride_ * elementSize();
+    const int64_t bytes = m_ * rowBytes;
+    if (interleave) {
+        topology.interleave(base, bytes);
+        return;
+    }
+    // 段的边界按 2M 对齐, 不会拆开透明大页
+    const uintptr_t granule = 2 << 20;
+    const uintptr_t start = reinterpret_cast<uintptr_t>(base);
+    const uintptr_t end = start + bytes;
+    uintptr_t prev = start;
+    const int32_t nodes = topology.nodes();
+    for (int32_t node = 0; node < nodes; node++) {
+        uintptr_t next = end;
+        if (node + 1 < nodes) {
+            next = (start + rowBytes * (m_ * (node + 1) / nodes)) / granule * granule;
+            next = std::min(std::max(next, prev), end);
         }
-        for (auto & item : threads) {
-            item.join();
+        if (next > prev) {
+            topology.bind(reinterpret_cast<void*>(prev), next - prev, node);
         }
-    } else {
-        // webassembly can't instantiate `std::thread`
-        uniformThread(a, 0, seed);
+        prev = next;
     }
 }
 
+void Matrix::uniformRows(real a, int64_t begin, int64_t end, int32_t seed) {
+    const uint64_t key = splitmix64(seed);
+    real buffer[HALF_CHUNK];
+    for (int64_t i = begin; i < end; i++) {
+        for (int64_t j = 0; j < n_; j += HALF_CHUNK) {
+            int64_t len = std::min(HALF_CHUNK, n_ - j);
+            real* out = dtype_ == dtype_name::fp32 ? data_ + i * stride_ + j : buffer;
+            for (int64_t k = 0; k < len; k++) {
+                // splitmix64 序列的第 (i * n + j + k) 项, 取高 24 位作为 [0, 1) 的浮点数
+                uint64_t bits = splitmix64(key + uint64_t(i * n_ + j + k) * 0x9E3779B97F4A7C15ULL);
+                out[k] = (real(bits >> 40) * (1.0f / 16777216.0f) * 2 - 1) * a;
+            }
+            if (dtype_ != dtype_name::fp32) {
+                storeRow(i, j, len, buffer);
+            }
+        }
+    }
+}
 
 real Matrix::dotRow(const Vector& vec, int64_t i) const {
     assert(i >= 0);
     assert(i < m_);
     assert(vec.size() == n_);
     real d = 0.0;
-    for (int64_t j = 0; j < n_; j++) {
-        d += at(i, j) * vec[j];
+    if (dtype_ == dtype_name::fp32) {
+        d = kernels::dot(data_ + i * stride_, vec.data(), n_);
+    } else {
+        real buffer[HALF_CHUNK];
+        for (int64_t j = 0; j < n_; j += HALF_CHUNK) {
+            int64_t len = std::min(HALF_CHUNK, n_ - j);
+            loadRow(i, j, len, buffer);
+            d += kernels::dot(buffer, vec.data() + j, len);
+        }
     }
     if (std::isnan(d)) {
         throw EncounteredNaNError();
@@ -81,8 +212,34 @@ void Matrix::addVectorToRow(const Vector& vec, int64_t i, real a) {
     assert(i >= 0);
     assert(i < m_);
     assert(vec.size() == n_);
-    for (int64_t j = 0; j < n_; j++) {
-        data_[i * n_ + j] += a * vec[j];
+    if (dtype_ == dtype_name::fp32) {
+        kernels::axpy(a, vec.data(), data_ + i * stride_, n_);
+        return;
+    }
+    real buffer[HALF_CHUNK];
+    for (int64_t j = 0; j < n_; j += HALF_CHUNK) {
+        int64_t len = std::min(HALF_CHUNK, n_ - j);
+        loadRow(i, j, len, buffer);
+        kernels::axpy(a, vec.data() + j, buffer, len);
+        storeRow(i, j, len, buffer);
+    }
+}
+
+void Matrix::updateRow(const Vector& vec, Vector& grad, int64_t i, real a) {
+    assert(i >= 0);
+    assert(i < m_);
+    assert(vec.size() == n_);
+    assert(grad.size() == n_);
+    if (dtype_ == dtype_name::fp32) {
+        kernels::update(a, vec.data(), data_ + i * stride_, grad.data(), n_);
+        return;
+    }
+    real buffer[HALF_CHUNK];
+    for (int64_t j = 0; j < n_; j += HALF_CHUNK) {
+        int64_t len = std::min(HALF_CHUNK, n_ - j);
+        loadRow(i, j, len, buffer);
+        kernels::update(a, vec.data() + j, buffer, grad.data() + j, len);
+        storeRow(i, j, len, buffer);
     }
 }
 
@@ -90,8 +247,15 @@ void Matrix::addRowToVector(Vector& x, int32_t i) const {
     assert(i >= 0);
     assert(i < this->size(0));
     assert(x.size() == this->size(1));
-    for (int64_t j = 0; j < n_; j++) {
-        x[j] += at(i, j);
+    if (dtype_ == dtype_name::fp32) {
+        kernels::add(data_ + i * stride_, x.data(), n_);
+        return;
+    }
+    real buffer[HALF_CHUNK];
+    for (int64_t j = 0; j < n_; j += HALF_CHUNK) {
+        int64_t len = std::min(HALF_CHUNK, n_ - j);
+        loadRow(i, j, len, buffer);
+        kernels::add(buffer, x.data() + j, len);
     }
 }
 
@@ -99,32 +263,77 @@ void Matrix::addRowToVector(Vector& x, int32_t i, real a) const {
     assert(i >= 0);
     assert(i < this->size(0));
     assert(x.size() == this->size(1));
-    for (int64_t j = 0; j < n_; j++) {
-        x[j] += a * at(i, j);
+    if (dtype_ == dtype_name::fp32) {
+        kernels::axpy(a, data_ + i * stride_, x.data(), n_);
+        return;
+    }
+    real buffer[HALF_CHUNK];
+    for (int64_t j = 0; j < n_; j += HALF_CHUNK) {
+        int64_t len = std::min(HALF_CHUNK, n_ - j);
+        loadRow(i, j, len, buffer);
+        kernels::axpy(a, buffer, x.data() + j, len);
     }
 }
 
 void Matrix::save(std::ostream& out) const {
     out.write((char*)&m_, sizeof(int64_t));
     out.write((char*)&n_, sizeof(int64_t));
-    out.write((char*)data_.data(), m_ * n_ * sizeof(real));
+    if (dtype_ == dtype_name::fp32) {
+        saveData(out);
+        return;
+    }
+    std::vector<real> buffer(n_);
+    for (int64_t i = 0; i < m_; i++) {
+        loadRow(i, 0, n_, buffer.data());
+        out.write((char*)buffer.data(), n_ * sizeof(real));
+    }
+}
+
+void Matrix::saveData(std::ostream& out) const {
+    const char* bytes = data_ ? (const char*)data_ : (const char*)half_;
+    if (stride_ == n_) {
+        out.write(bytes, m_ * n_ * elementSize());
+        return;
+    }
+    for (int64_t i = 0; i < m_; i++) {
+        out.write(bytes + i * stride_ * elementSize(), n_ * elementSize());
+    }
+}
+
+void Matrix::loadData(std::istream& in) {
+    char* bytes = data_ ? (char*)data_ : (char*)half_;
+    if (stride_ == n_) {
+        in.read(bytes, m_ * n_ * elementSize());
+        return;
+    }
+    for (int64_t i = 0; i < m_; i++) {
+        in.read(bytes + i * stride_ * elementSize(), n_ * elementSize());
+    }
 }
 
 void Matrix::load(std::istream& in) {
     in.read((char*)&m_, sizeof(int64_t));
     in.read((char*)&n_, sizeof(int64_t));
-    data_ = std::vector<real>(m_ * n_);
-    in.read((char*)data_.data(), m_ * n_ * sizeof(real));
+    stride_ = n_;
+    dtype_ = dtype_name::fp32;
+    allocate(false);
+    in.read((char*)data_, m_ * n_ * sizeof(real));
 }
 
 void Matrix::dump(std::ostream& out) const {
     out << m_ << " " << n_ << std::endl;
+    std::vector<real> buffer(n_);
     for (int64_t i = 0; i < m_; i++) {
+        if (dtype_ == dtype_name::fp32) {
+            std::copy(row(i), row(i) + n_, buffer.begin());
+        } else {
+            loadRow(i, 0, n_, buffer.data());
+        }
         for (int64_t j = 0; j < n_; j++) {
             if (j > 0) {
                 out << " ";
             }
-            out << at(i, j);
+            out << buffer[j];
         }
         out << std::endl;
     }
@@ -5,7 +5,9 @@
 #ifndef WORD2VEC_MATRIX_H
 #define WORD2VEC_MATRIX_H
 
+#include <cassert>
 #include <istream>
+#include <memory>
 #include <ostream>
 #include <vector>
 #include <stdexcept>
@@ -14,23 +16,54 @@
 namespace word2vec {
 
 class Vector;
+class NumaTopology;
 
 class Matrix {
 private:
     int64_t m_;
     int64_t n_;
-    std::vector<real> data_;
-
-    void uniformThread(real, int, int32_t);
+    int64_t stride_; // 相邻两行的距离, 按 cache line 对齐时大于 n_
+    dtype_name dtype_;
+    std::shared_ptr<void> storage_; // 自己分配的内存, 64 字节对齐
+    // 指向 storage_ 或者外部的内存(比如 mmap 的模型文件), owner_ 保证外部内存不被提前释放
+    // fp32 时用 data_, fp16/bf16 时用 half_, 另一个是空指针
+    real *data_;
+    uint16_t *half_;
+    std::shared_ptr<void> owner_;
+
+    void allocate(bool hugePages);
+    void loadRow(int64_t i, int64_t begin, int64_t n, real *buffer) const;
+    void storeRow(int64_t i, int64_t begin, int64_t n, const real *buffer);
 
 public:
     Matrix();
 
     explicit Matrix(int64_t, int64_t);
 
+    // alignRows: 每行补齐到 cache line 的整数倍, 一行不会跨额外的 cache line
+    // hugePages: 请求透明大页, 减少大矩阵随机访问行时的 TLB miss
+    // dtype: fp16/bf16 时每个元素 2 字节, 行运算先转成 real 再计算
+    explicit Matrix(
+            int64_t m,
+            int64_t n,
+            bool alignRows,
+            bool hugePages,
+            dtype_name dtype = dtype_name::fp32);
+
     explicit Matrix(int64_t m, int64_t n, real *dataPtr);
 
-    Matrix(const Matrix &) = default;
+    // 不拷贝数据, 直接使用 owner 持有的内存
+    explicit Matrix(int64_t m, int64_t n, real *dataPtr, std::shared_ptr<void> owner);
+
+    // 半精度数据的视图
+    explicit Matrix(
+            int64_t m,
+            int64_t n,
+            uint16_t *dataPtr,
+            dtype_name dtype,
+            std::shared_ptr<void> owner);
+
+    Matrix(const Matrix &);
 
     Matrix(Matrix &&) noexcept;
 
@@ -42,21 +75,36 @@ public:
 
     int64_t size(int64_t dim) const;
 
+    // data/row/at 只能用在 fp32 的矩阵上
     inline real *data() {
-        return data_.data();
+        assert(dtype_ == dtype_name::fp32);
+        return data_;
     }
 
     inline const real *data() const {
-        return data_.data();
+        assert(dtype_ == dtype_name::fp32);
+        return data_;
+    }
+
+    inline real *row(int64_t i) {
+        assert(dtype_ == dtype_name::fp32);
+        return data_ + i * stride_;
+    }
+
+    inline const real *row(int64_t i) const {
+        assert(dtype_ == dtype_name::fp32);
+        return data_ + i * stride_;
     }
 
     inline const real &at(int64_t i, int64_t j) const {
-        assert(i * n_ + j < data_.size());
-        return data_[i * n_ + j];
+        assert(dtype_ == dtype_name::fp32);
+        assert(i < m_ && j < n_);
+        return data_[i * stride_ + j];
     };
 
     inline real &at(int64_t i, int64_t j) {
-        return data_[i * n_ + j];
+        assert(dtype_ == dtype_name::fp32);
+        return data_[i * stride_ + j];
     };
 
     inline int64_t rows() const {
@@ -67,22 +115,56 @@ public:
         return n_;
     }
 
+    inline int64_t stride() const {
+        return stride_;
+    }
+
+    inline dtype_name dtype() const {
+        return dtype_;
+    }
+
+    inline int64_t elementSize() const {
+        return dtype_ == dtype_name::fp32 ? sizeof(real) : sizeof(uint16_t);
+    }
+
+    inline bool isView() const {
+        return owner_ != nullptr;
+    }
+
     void zero();
 
-    void uniform(real, unsigned int, int32_t);
+    // 改变行数, 保留已有的行, 新增的行是 0; 视图会变成自己持有的数据
+    void resizeRows(int64_t m, bool hugePages);
+
+    // [begin, end) 这些行按均匀分布 [-a, a) 初始化, 第 k 个元素只由 seed 和 k 决定,
+    // 结果和怎么分块、用几个线程无关
+    void uniformRows(real a, int64_t begin, int64_t end, int32_t seed);
+
+    // interleave: 按页轮流放在所有节点上; 否则按行切成连续的段, 每段放在一个节点上
+    void distribute(const NumaTopology &topology, bool interleave);
 
     real dotRow(const Vector &, int64_t) const;
 
     void addVectorToRow(const Vector &, int64_t, real);
 
+    // grad += a * 第i行, 然后 第i行 += a * vec, 一次遍历完成
+    void updateRow(const Vector &vec, Vector &grad, int64_t i, real a);
+
     void addRowToVector(Vector &x, int32_t i) const;
 
     void addRowToVector(Vector &x, int32_t i, real a) const;
 
+    // 总是写成 fp32
     void save(std::ostream &) const;
 
+    // 按存储精度写 m*n 个元素, 去掉行尾的补齐
+    void saveData(std::ostream &) const;
+
     void load(std::istream &);
 
+    // 按存储精度读 m*n 个元素到已经分配好的矩阵, saveData 的逆操作
+    void loadData(std::istream &);
+
     void dump(std::ostream &) const;
 
     class EncounteredNaNError : public std::runtime_error {
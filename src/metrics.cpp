@@ -0,0 +1,111 @@
+//
+// Created by fengjiaxin on 2023/5/19.
+//
+
+#include "metrics.h"
+
+#include "utils.h"
+
+#include <iomanip>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+
+namespace word2vec {
+
+TrainMetrics::TrainMetrics(
+        const std::string& filename,
+        int32_t thread,
+        int32_t interval)
+        : out_(filename),
+          thread_(thread),
+          interval_(interval),
+          storage_(utils::allocAligned(int64_t(sizeof(ThreadStats)) * thread, false)),
+          threads_(static_cast<ThreadStats*>(storage_.get())),
+          start_(Clock::now()),
+          last_(start_),
+          lastTokens_(0),
+          lastExamples_(0) {
+    if (!out_.is_open()) {
+        throw std::invalid_argument(filename + " cannot be opened for metrics!");
+    }
+    for (int32_t i = 0; i < thread_; i++) {
+        new (threads_ + i) ThreadStats();
+    }
+}
+
+TrainMetrics::~TrainMetrics() {
+    for (int32_t i = 0; i < thread_; i++) {
+        threads_[i].~ThreadStats();
+    }
+}
+
+bool TrainMetrics::maybeWrite(real progress, real lr) {
+    if (Clock::now() - last_ < interval_) {
+        return false;
+    }
+    write(progress, lr, "progress");
+    return true;
+}
+
+void TrainMetrics::write(real progress, real lr, const std::string& event) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Clock::time_point now = Clock::now();
+    double elapsed = std::chrono::duration<double>(now - start_).count();
+    double window = std::chrono::duration<double>(now - last_).count();
+
+    int64_t tokens = 0;
+    int64_t examples = 0;
+    int64_t readNanos = 0;
+    int64_t updateNanos = 0;
+    int64_t sampleNanos = 0;
+    double loss = 0;
+    int32_t lossThreads = 0;
+    std::ostringstream perThread;
+    for (int32_t i = 0; i < thread_; i++) {
+        const ThreadStats& stats = threads_[i];
+        int64_t t = stats.tokens.load(std::memory_order_relaxed);
+        int64_t e = stats.examples.load(std::memory_order_relaxed);
+        int64_t r = stats.readNanos.load(std::memory_order_relaxed);
+        int64_t u = stats.updateNanos.load(std::memory_order_relaxed);
+        int64_t s = stats.sampleNanos.load(std::memory_order_relaxed);
+        real l = stats.loss.load(std::memory_order_relaxed);
+        tokens += t;
+        examples += e;
+        readNanos += r;
+        updateNanos += u;
+        sampleNanos += s;
+        if (e > 0) {
+            loss += l;
+            lossThreads++;
+        }
+        perThread << (i > 0 ? ", " : "") << "{\"id\": " << i
+                  << ", \"tokens\": " << t << ", \"examples\": " << e
+                  << ", \"loss\": " << l << ", \"read_sec\": " << r * 1e-9
+                  << ", \"update_sec\": " << u * 1e-9
+                  << ", \"sample_sec\": " << s * 1e-9 << "}";
+    }
+    if (lossThreads > 0) {
+        loss /= lossThreads;
+    }
+    // 区间内的速率, 第一条记录就是从开始到现在
+    double tokensPerSec = window > 0 ? (tokens - lastTokens_) / window : 0;
+    double examplesPerSec = window > 0 ? (examples - lastExamples_) / window : 0;
+
+    out_ << std::setprecision(6) << "{\"event\": \"" << event << "\""
+         << ", \"time\": " << elapsed << ", \"progress\": " << progress
+         << ", \"lr\": " << lr << ", \"loss\": " << loss
+         << ", \"tokens\": " << tokens << ", \"examples\": " << examples
+         << ", \"words_per_sec\": " << tokensPerSec
+         << ", \"examples_per_sec\": " << examplesPerSec
+         << ", \"read_sec\": " << readNanos * 1e-9
+         << ", \"update_sec\": " << updateNanos * 1e-9
+         << ", \"sample_sec\": " << sampleNanos * 1e-9
+         << ", \"threads\": [" << perThread.str() << "]}" << std::endl;
+
+    last_ = now;
+    lastTokens_ = tokens;
+    lastExamples_ = examples;
+}
+
+} // namespace word2vec
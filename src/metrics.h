@@ -0,0 +1,63 @@
+//
+// Created by fengjiaxin on 2023/5/19.
+//
+
+#ifndef WORD2VEC_METRICS_H
+#define WORD2VEC_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "real.h"
+
+namespace word2vec {
+
+// 训练过程的指标, 每个线程只写自己的一份, 定期以 json lines 追加到文件
+// 时间拆成三部分: 读取和分词(getLine), 前向反向(Model::update, 不含采样), 负采样
+class TrainMetrics {
+public:
+    // 每个线程的累计值, 对齐到 cache line 避免线程之间伪共享
+    struct alignas(64) ThreadStats {
+        std::atomic<int64_t> tokens{0};
+        std::atomic<int64_t> examples{0};
+        std::atomic<int64_t> readNanos{0};
+        std::atomic<int64_t> updateNanos{0};
+        std::atomic<int64_t> sampleNanos{0};
+        std::atomic<real> loss{0};
+    };
+
+    TrainMetrics(const std::string& filename, int32_t thread, int32_t interval);
+    ~TrainMetrics();
+
+    ThreadStats& stats(int32_t threadId) {
+        return threads_[threadId];
+    }
+
+    // 距离上一条记录超过 interval 秒才写, 返回是否写了, 训练时只由 0 号线程调用
+    bool maybeWrite(real progress, real lr);
+
+    void write(real progress, real lr, const std::string& event);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    std::ofstream out_;
+    int32_t thread_;
+    std::chrono::seconds interval_;
+    // C++11 的 new[] 不保证 alignas(64), 用对齐分配的内存再逐个构造
+    std::shared_ptr<void> storage_;
+    ThreadStats* threads_;
+    std::mutex mutex_;
+    Clock::time_point start_;
+    Clock::time_point last_;
+    int64_t lastTokens_;
+    int64_t lastExamples_;
+};
+
+} // namespace word2vec
+
+#endif //WORD2VEC_METRICS_H
@@ -12,17 +12,25 @@
 
 namespace word2vec {
 
-Model::State::State(int32_t hiddenSize, int32_t outputSize)
+Model::State::State(int32_t hiddenSize, int32_t outputSize, int32_t seed)
         : lossValue_(0.0),
           nexamples_(0),
           hidden(hiddenSize),
           output(outputSize),
-          grad(hiddenSize) {}
+          grad(hiddenSize),
+          rng(seed),
+          profile(false),
+          profileTick(0),
+          sampleNanos(0) {}
 
 real Model::State::getLoss() const {
     return lossValue_ / nexamples_;
 }
 
+int64_t Model::State::getNExamples() const {
+    return nexamples_;
+}
+
 void Model::State::incrementNExamples(real loss) {
     lossValue_ += loss;
     ++nexamples_;
@@ -41,7 +49,9 @@ const {
     for (auto it = input.cbegin(); it != input.cend(); ++it) {
         hidden.addRow(*wi_, *it);
     }
-    hidden.mul(1.0 / input.size());
+    if (input.size() > 1) {
+        hidden.mul(1.0 / input.size());
+    }
 }
 
 void Model::predict(
@@ -82,4 +92,27 @@ void Model::update(
     }
 }
 
+void Model::update(
+        const std::vector<int32_t> &input,
+        const std::vector<int32_t> &targets,
+        const std::vector<int32_t> &targetIndices,
+        real lr,
+        State &state) {
+    if (input.size() == 0 || targetIndices.size() == 0) {
+        return;
+    }
+    computeHidden(input, state);
+
+    Vector &grad = state.grad;
+    grad.zero();
+    for (auto it = targetIndices.cbegin(); it != targetIndices.cend(); ++it) {
+        real lossValue = loss_->forward(targets, *it, state, lr, true);
+        state.incrementNExamples(lossValue);
+    }
+
+    for (auto it = input.cbegin(); it != input.cend(); ++it) {
+        wi_->addVectorToRow(grad, *it, 1.0);
+    }
+}
+
 } // namespace word2vec
@@ -11,6 +11,7 @@
 
 #include "matrix.h"
 #include "real.h"
+#include "rng.h"
 #include "utils.h"
 #include "vector.h"
 
@@ -44,9 +45,15 @@ public:
         Vector hidden;
         Vector output;
         Vector grad;
+        XorShiftRng rng; // 每个线程一份, 负采样不再竞争同一个随机数发生器
+        std::vector<int32_t> negatives;
+        bool profile; // 打开时统计负采样耗时, 写入 sampleNanos
+        int64_t profileTick;
+        int64_t sampleNanos;
 
-        State(int32_t hiddenSize, int32_t outputSize);
+        State(int32_t hiddenSize, int32_t outputSize, int32_t seed);
         real getLoss() const;
+        int64_t getNExamples() const;
         void incrementNExamples(real loss);
     };
 
@@ -62,6 +69,13 @@ public:
             int32_t targetIndex,
             real lr,
             State& state);
+    // 同一个 input 对多个 target 的批量更新, hidden 只算一次, input 的梯度累加后只写回一次
+    void update(
+            const std::vector<int32_t>& input,
+            const std::vector<int32_t>& targets,
+            const std::vector<int32_t>& targetIndices,
+            real lr,
+            State& state);
     void computeHidden(const std::vector<int32_t>& input, State& state) const;
 
 };
@@ -0,0 +1,160 @@
+//
+// Created by fengjiaxin on 2023/5/23.
+//
+
+#include "numa.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+namespace word2vec {
+
+namespace {
+
+// <numaif.h> 属于 libnuma, 这里只需要几个常量
+const int MPOL_BIND_MODE = 2;
+const int MPOL_INTERLEAVE_MODE = 3;
+const unsigned MPOL_MF_MOVE_FLAG = 1 << 1;
+const int32_t MAX_NODES = 1024;
+
+// 解析 "0-3,8,10-11" 这样的 cpu 列表
+std::vector<int32_t> parseList(const std::string& text) {
+    std::vector<int32_t> result;
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty() || item == "\n") {
+            continue;
+        }
+        size_t dash = item.find('-');
+        int32_t first = std::stoi(item.substr(0, dash));
+        int32_t last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+        for (int32_t cpu = first; cpu <= last; cpu++) {
+            result.push_back(cpu);
+        }
+    }
+    return result;
+}
+
+} // namespace
+
+NumaTopology NumaTopology::detect() {
+    NumaTopology topology;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool hasAffinity = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+    for (int32_t node = 0; node < MAX_NODES; node++) {
+        std::ifstream ifs(
+                "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!ifs.is_open()) {
+            continue;
+        }
+        std::string line;
+        std::getline(ifs, line);
+        std::vector<int32_t> cpus;
+        for (int32_t cpu : parseList(line)) {
+            if (!hasAffinity || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))) {
+                cpus.push_back(cpu);
+            }
+        }
+        // 只有内存没有可用 cpu 的节点不参与
+        if (!cpus.empty()) {
+            topology.nodes_.push_back(node);
+            topology.cpus_.push_back(cpus);
+        }
+    }
+    if (topology.nodes_.empty()) {
+        std::vector<int32_t> cpus;
+        for (int32_t cpu = 0; cpu < int32_t(std::thread::hardware_concurrency()); cpu++) {
+            cpus.push_back(cpu);
+        }
+        topology.nodes_.push_back(0);
+        topology.cpus_.push_back(cpus);
+    }
+    return topology;
+}
+
+int32_t NumaTopology::nodes() const {
+    return nodes_.size();
+}
+
+int32_t NumaTopology::nodeOf(int32_t threadId, int32_t thread) const {
+    return int64_t(threadId) * nodes() / std::max(thread, 1);
+}
+
+bool NumaTopology::pin(int32_t threadId, int32_t thread) const {
+    const int32_t node = nodeOf(threadId, thread);
+    const std::vector<int32_t>& cpus = cpus_[node];
+    if (cpus.empty()) {
+        return false;
+    }
+    // 节点内第几个线程
+    int32_t first = 0;
+    while (nodeOf(first, thread) != node) {
+        first++;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[(threadId - first) % cpus.size()], &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+ScopedPin::ScopedPin(const NumaTopology& topology, int32_t threadId, int32_t thread)
+        : pinned_(false) {
+    // 取不到原来的 affinity 就不绑定, 免得之后恢复不了
+    if (pthread_getaffinity_np(pthread_self(), sizeof(saved_), &saved_) == 0) {
+        pinned_ = topology.pin(threadId, thread);
+    }
+}
+
+ScopedPin::~ScopedPin() {
+    if (pinned_) {
+        pthread_setaffinity_np(pthread_self(), sizeof(saved_), &saved_);
+    }
+}
+
+bool NumaTopology::mbind(
+        void* addr,
+        size_t bytes,
+        int mode,
+        const std::vector<int32_t>& nodes) const {
+    if (bytes == 0 || nodes_.size() < 2) {
+        return false;
+    }
+    const size_t bits = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> mask(MAX_NODES / bits, 0);
+    for (int32_t node : nodes) {
+        mask[node / bits] |= 1UL << (node % bits);
+    }
+    // mbind 要求起始地址按页对齐
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = reinterpret_cast<uintptr_t>(addr) / page * page;
+    uintptr_t end = reinterpret_cast<uintptr_t>(addr) + bytes;
+    return syscall(
+                   SYS_mbind,
+                   begin,
+                   end - begin,
+                   mode,
+                   mask.data(),
+                   mask.size() * bits + 1,
+                   MPOL_MF_MOVE_FLAG) == 0;
+}
+
+bool NumaTopology::interleave(void* addr, size_t bytes) const {
+    return mbind(addr, bytes, MPOL_INTERLEAVE_MODE, nodes_);
+}
+
+bool NumaTopology::bind(void* addr, size_t bytes, int32_t node) const {
+    return mbind(addr, bytes, MPOL_BIND_MODE, {nodes_[node]});
+}
+
+} // namespace word2vec
@@ -0,0 +1,56 @@
+//
+// Created by fengjiaxin on 2023/5/23.
+// NUMA 拓扑: 从 sysfs 读取每个节点的 cpu, 绑定线程, 用 mbind 指定内存放在哪些节点上.
+// 不依赖 libnuma, 单节点的机器或者内核不支持时这些操作什么都不做
+
+#ifndef WORD2VEC_NUMA_H
+#define WORD2VEC_NUMA_H
+
+#include <sched.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace word2vec {
+
+class NumaTopology {
+private:
+    std::vector<int32_t> nodes_; // 节点编号
+    std::vector<std::vector<int32_t>> cpus_; // 每个节点上本进程可以使用的 cpu
+
+    bool mbind(void* addr, size_t bytes, int mode, const std::vector<int32_t>& nodes) const;
+
+public:
+    // 读取当前机器的拓扑, 读不到时当作只有一个节点
+    static NumaTopology detect();
+
+    int32_t nodes() const;
+    // 线程按编号连续地分给各个节点, 同一个节点的线程读相邻的语料分片
+    int32_t nodeOf(int32_t threadId, int32_t thread) const;
+    // 把线程绑定到所在节点的一个 cpu 上, 返回是否成功
+    bool pin(int32_t threadId, int32_t thread) const;
+    // [addr, addr + bytes) 按页轮流放在所有节点上, 已经分配的页会被迁移
+    bool interleave(void* addr, size_t bytes) const;
+    // [addr, addr + bytes) 放在第 node 个节点上, 已经分配的页会被迁移
+    bool bind(void* addr, size_t bytes, int32_t node) const;
+};
+
+// 作用域内把当前线程绑定到所在节点的 cpu 上, 离开时恢复原来的 affinity,
+// 线程池的线程训练完之后还要做别的工作, 不能一直绑在一个 cpu 上
+class ScopedPin {
+private:
+    cpu_set_t saved_;
+    bool pinned_;
+
+public:
+    ScopedPin(const NumaTopology& topology, int32_t threadId, int32_t thread);
+    ~ScopedPin();
+
+    ScopedPin(const ScopedPin&) = delete;
+    ScopedPin& operator=(const ScopedPin&) = delete;
+};
+
+} // namespace word2vec
+
+#endif //WORD2VEC_NUMA_H
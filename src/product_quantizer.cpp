@@ -0,0 +1,240 @@
+//
+// Created by fengjiaxin on 2023/5/20.
+//
+
+#include "product_quantizer.h"
+#include "kernels.h"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+
+namespace word2vec {
+
+const int32_t ProductQuantizer::NBITS;
+const int32_t ProductQuantizer::KSUB;
+const int32_t ProductQuantizer::MAX_POINTS_PER_CLUSTER;
+const int32_t ProductQuantizer::MAX_POINTS;
+const int32_t ProductQuantizer::NITER;
+
+namespace {
+
+real distL2(const real* x, const real* y, int32_t d) {
+    real dist = 0;
+    for (int32_t i = 0; i < d; i++) {
+        real tmp = x[i] - y[i];
+        dist += tmp * tmp;
+    }
+    return dist;
+}
+
+} // namespace
+
+ProductQuantizer::ProductQuantizer()
+        : dim_(0), nsubq_(0), dsub_(0), lastdsub_(0), seed_(0) {}
+
+ProductQuantizer::ProductQuantizer(int32_t dim, int32_t dsub, int32_t seed)
+        : dim_(dim),
+          nsubq_(dim / dsub),
+          dsub_(dsub),
+          lastdsub_(dim % dsub),
+          seed_(seed),
+          centroids_(dim * KSUB) {
+    if (lastdsub_ == 0) {
+        lastdsub_ = dsub_;
+    } else {
+        nsubq_++;
+    }
+}
+
+real* ProductQuantizer::getCentroids(int32_t m, uint8_t i) {
+    if (m == nsubq_ - 1) {
+        return &centroids_[m * KSUB * dsub_ + i * lastdsub_];
+    }
+    return &centroids_[(m * KSUB + i) * dsub_];
+}
+
+const real* ProductQuantizer::getCentroids(int32_t m, uint8_t i) const {
+    if (m == nsubq_ - 1) {
+        return &centroids_[m * KSUB * dsub_ + i * lastdsub_];
+    }
+    return &centroids_[(m * KSUB + i) * dsub_];
+}
+
+real ProductQuantizer::assignCentroid(
+        const real* x,
+        const real* c0,
+        uint8_t* code,
+        int32_t d) const {
+    const real* c = c0;
+    real dis = distL2(x, c, d);
+    code[0] = 0;
+    for (int32_t j = 1; j < KSUB; j++) {
+        c += d;
+        real disij = distL2(x, c, d);
+        if (disij < dis) {
+            code[0] = (uint8_t)j;
+            dis = disij;
+        }
+    }
+    return dis;
+}
+
+void ProductQuantizer::eStep(
+        const real* x,
+        const real* centroids,
+        uint8_t* codes,
+        int32_t d,
+        int32_t n) const {
+    for (int32_t i = 0; i < n; i++) {
+        assignCentroid(x + i * d, centroids, codes + i, d);
+    }
+}
+
+void ProductQuantizer::mStep(
+        const real* x0,
+        real* centroids,
+        const uint8_t* codes,
+        int32_t d,
+        int32_t n,
+        std::minstd_rand& rng) {
+    std::vector<int32_t> nelts(KSUB, 0);
+    std::fill(centroids, centroids + d * KSUB, 0);
+    const real* x = x0;
+    for (int32_t i = 0; i < n; i++) {
+        uint8_t k = codes[i];
+        real* c = centroids + k * d;
+        for (int32_t j = 0; j < d; j++) {
+            c[j] += x[j];
+        }
+        nelts[k]++;
+        x += d;
+    }
+
+    real* c = centroids;
+    for (int32_t k = 0; k < KSUB; k++) {
+        real z = (real)nelts[k];
+        if (z != 0) {
+            for (int32_t j = 0; j < d; j++) {
+                c[j] /= z;
+            }
+        }
+        c += d;
+    }
+
+    // 空的簇从大簇里分裂出来, 两个中心在相反方向上稍微偏移
+    const real eps = 1e-7;
+    std::uniform_real_distribution<> runiform(0, 1);
+    for (int32_t k = 0; k < KSUB; k++) {
+        if (nelts[k] == 0) {
+            int32_t m = 0;
+            while (runiform(rng) * (n - KSUB) >= nelts[m] - 1) {
+                m = (m + 1) % KSUB;
+            }
+            std::memcpy(centroids + k * d, centroids + m * d, sizeof(real) * d);
+            for (int32_t j = 0; j < d; j++) {
+                int32_t sign = (j % 2) * 2 - 1;
+                centroids[k * d + j] += sign * eps;
+                centroids[m * d + j] -= sign * eps;
+            }
+            nelts[k] = nelts[m] / 2;
+            nelts[m] -= nelts[k];
+        }
+    }
+}
+
+void ProductQuantizer::kmeans(const real* x, real* c, int32_t n, int32_t d, int32_t seed) {
+    std::minstd_rand rng(seed);
+    std::vector<int32_t> perm(n, 0);
+    std::iota(perm.begin(), perm.end(), 0);
+    std::shuffle(perm.begin(), perm.end(), rng);
+    for (int32_t i = 0; i < KSUB; i++) {
+        std::memcpy(&c[i * d], x + perm[i] * d, d * sizeof(real));
+    }
+    std::vector<uint8_t> codes(n);
+    for (int32_t i = 0; i < NITER; i++) {
+        eStep(x, c, codes.data(), d, n);
+        mStep(x, c, codes.data(), d, n, rng);
+    }
+}
+
+void ProductQuantizer::train(int32_t n, const real* x, int32_t thread, ThreadPool& pool) {
+    if (n < KSUB) {
+        throw std::invalid_argument(
+                "Matrix too small for quantization, must have at least " +
+                std::to_string(KSUB) + " rows");
+    }
+    const int32_t np = std::min(n, MAX_POINTS);
+    std::minstd_rand rng(seed_);
+    std::vector<int32_t> perm(n, 0);
+    std::iota(perm.begin(), perm.end(), 0);
+    std::shuffle(perm.begin(), perm.end(), rng);
+
+    // 每段用同一批随机挑出来的行, 各段的种子不同
+    auto trainSubq = [&](int32_t m) {
+        int32_t d = subDim(m);
+        std::vector<real> xslice(np * d);
+        for (int32_t j = 0; j < np; j++) {
+            std::memcpy(
+                    xslice.data() + j * d,
+                    x + int64_t(perm[j]) * dim_ + m * dsub_,
+                    d * sizeof(real));
+        }
+        kmeans(xslice.data(), getCentroids(m, 0), np, d, seed_ + m);
+    };
+    pool.run(thread, [&](int32_t t) {
+        for (int32_t m = t; m < nsubq_; m += thread) {
+            trainSubq(m);
+        }
+    });
+}
+
+void ProductQuantizer::computeCode(const real* x, uint8_t* code) const {
+    for (int32_t m = 0; m < nsubq_; m++) {
+        assignCentroid(x + m * dsub_, getCentroids(m, 0), code + m, subDim(m));
+    }
+}
+
+void ProductQuantizer::addCode(Vector& x, const uint8_t* code, real alpha) const {
+    for (int32_t m = 0; m < nsubq_; m++) {
+        const real* c = getCentroids(m, code[m]);
+        kernels::axpy(alpha, c, x.data() + m * dsub_, subDim(m));
+    }
+}
+
+void ProductQuantizer::distanceTable(const real* query, real* table) const {
+    for (int32_t m = 0; m < nsubq_; m++) {
+        int32_t d = subDim(m);
+        const real* q = query + m * dsub_;
+        const real* c = getCentroids(m, 0);
+        for (int32_t k = 0; k < KSUB; k++) {
+            real s = 0.0;
+            for (int32_t j = 0; j < d; j++) {
+                s += q[j] * c[j];
+            }
+            table[m * KSUB + k] = s;
+            c += d;
+        }
+    }
+}
+
+void ProductQuantizer::save(std::ostream& out) const {
+    out.write((char*)&dim_, sizeof(dim_));
+    out.write((char*)&nsubq_, sizeof(nsubq_));
+    out.write((char*)&dsub_, sizeof(dsub_));
+    out.write((char*)&lastdsub_, sizeof(lastdsub_));
+    out.write((char*)centroids_.data(), centroids_.size() * sizeof(real));
+}
+
+void ProductQuantizer::load(std::istream& in) {
+    in.read((char*)&dim_, sizeof(dim_));
+    in.read((char*)&nsubq_, sizeof(nsubq_));
+    in.read((char*)&dsub_, sizeof(dsub_));
+    in.read((char*)&lastdsub_, sizeof(lastdsub_));
+    centroids_.resize(dim_ * KSUB);
+    in.read((char*)centroids_.data(), centroids_.size() * sizeof(real));
+}
+
+} // namespace word2vec
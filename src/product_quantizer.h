@@ -0,0 +1,90 @@
+//
+// Created by fengjiaxin on 2023/5/20.
+// 乘积量化: 向量切成 dsub 维的子向量, 每段用 256 个中心的 k-means 编码成 1 个字节
+
+#ifndef WORD2VEC_PRODUCT_QUANTIZER_H
+#define WORD2VEC_PRODUCT_QUANTIZER_H
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <random>
+#include <vector>
+
+#include "real.h"
+#include "thread_pool.h"
+#include "vector.h"
+
+namespace word2vec {
+
+class ProductQuantizer {
+private:
+    static const int32_t NBITS = 8;
+    static const int32_t KSUB = 1 << NBITS;
+    static const int32_t MAX_POINTS_PER_CLUSTER = 256;
+    static const int32_t MAX_POINTS = MAX_POINTS_PER_CLUSTER * KSUB;
+    static const int32_t NITER = 25;
+
+    int32_t dim_;
+    int32_t nsubq_;
+    int32_t dsub_;
+    int32_t lastdsub_; // dim 不能被 dsub 整除时, 最后一段的维数
+    int32_t seed_;
+    std::vector<real> centroids_; // nsubq_ * KSUB 个中心, 第 m 段的中心是 dsub_ 维
+
+    int32_t subDim(int32_t m) const {
+        return m == nsubq_ - 1 ? lastdsub_ : dsub_;
+    }
+
+    real* getCentroids(int32_t m, uint8_t i);
+    const real* getCentroids(int32_t m, uint8_t i) const;
+
+    real assignCentroid(const real* x, const real* c0, uint8_t* code, int32_t d) const;
+    void eStep(const real* x, const real* centroids, uint8_t* codes, int32_t d, int32_t n) const;
+    void mStep(const real* x0, real* centroids, const uint8_t* codes, int32_t d, int32_t n, std::minstd_rand& rng);
+    void kmeans(const real* x, real* c, int32_t n, int32_t d, int32_t seed);
+
+public:
+    ProductQuantizer();
+    ProductQuantizer(int32_t dim, int32_t dsub, int32_t seed);
+
+    int32_t nsubq() const {
+        return nsubq_;
+    }
+
+    static int32_t ksub() {
+        return KSUB;
+    }
+
+    // 训练最多用这么多行, 多出来的行不会让中心更准
+    static int32_t maxPoints() {
+        return MAX_POINTS;
+    }
+
+    // x 是 n 行 dim_ 列的稠密矩阵, 各段的 k-means 互不相关, 按段分给线程
+    void train(int32_t n, const real* x, int32_t thread, ThreadPool& pool);
+
+    void computeCode(const real* x, uint8_t* code) const;
+
+    // x += alpha * 解码出来的向量
+    void addCode(Vector& x, const uint8_t* code, real alpha) const;
+
+    // 非对称距离表: table[m * KSUB + c] = 查询的第 m 段和第 m 段第 c 个中心的内积
+    void distanceTable(const real* query, real* table) const;
+
+    // 用距离表算查询和一个编码向量的内积, 只需要 nsubq_ 次查表
+    inline real score(const real* table, const uint8_t* code) const {
+        real s = 0.0;
+        for (int32_t m = 0; m < nsubq_; m++) {
+            s += table[m * KSUB + code[m]];
+        }
+        return s;
+    }
+
+    void save(std::ostream&) const;
+    void load(std::istream&);
+};
+
+} // namespace word2vec
+
+#endif //WORD2VEC_PRODUCT_QUANTIZER_H
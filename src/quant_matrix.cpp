@@ -0,0 +1,125 @@
+//
+// Created by fengjiaxin on 2023/5/20.
+//
+
+#include "quant_matrix.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <numeric>
+#include <random>
+
+namespace word2vec {
+
+namespace {
+
+bool compareScores(
+        const std::pair<real, int32_t>& l,
+        const std::pair<real, int32_t>& r) {
+    return l.first > r.first;
+}
+
+} // namespace
+
+QuantMatrix::QuantMatrix() : m_(0), n_(0) {}
+
+QuantMatrix::QuantMatrix(
+        const Matrix& mat,
+        int32_t dsub,
+        int32_t thread,
+        int32_t seed,
+        ThreadPool& pool)
+        : m_(mat.rows()),
+          n_(mat.cols()),
+          pq_(mat.cols(), dsub, seed),
+          codes_(mat.rows() * pq_.nsubq()),
+          norms_(mat.rows()) {
+    // 矩阵可能是补齐过的或者半精度的, 训练用的行先展开成稠密的 real
+    std::vector<int64_t> sample(m_);
+    std::iota(sample.begin(), sample.end(), 0);
+    if (m_ > ProductQuantizer::maxPoints()) {
+        std::minstd_rand rng(seed);
+        std::shuffle(sample.begin(), sample.end(), rng);
+        sample.resize(ProductQuantizer::maxPoints());
+    }
+    std::vector<real> dense(sample.size() * n_);
+    Vector vec(n_);
+    for (size_t i = 0; i < sample.size(); i++) {
+        vec.zero();
+        mat.addRowToVector(vec, sample[i]);
+        std::copy(vec.data(), vec.data() + n_, dense.begin() + i * n_);
+    }
+    pq_.train(sample.size(), dense.data(), thread, pool);
+
+    // 编码每行都要和所有中心比较, 按行分给线程
+    pool.run(thread, [&](int32_t t) {
+        Vector row(n_);
+        Vector decoded(n_);
+        for (int64_t i = m_ * t / thread; i < m_ * (t + 1) / thread; i++) {
+            uint8_t* code = codes_.data() + i * pq_.nsubq();
+            row.zero();
+            mat.addRowToVector(row, i);
+            pq_.computeCode(row.data(), code);
+            decoded.zero();
+            pq_.addCode(decoded, code, 1.0);
+            norms_[i] = decoded.norm();
+        }
+    });
+}
+
+void QuantMatrix::addRowToVector(Vector& x, int64_t i) const {
+    assert(i >= 0 && i < m_);
+    assert(x.size() == n_);
+    pq_.addCode(x, codes_.data() + i * pq_.nsubq(), 1.0);
+}
+
+Predictions QuantMatrix::topK(const Vector& query, int32_t k, int32_t banId) const {
+    real queryNorm = query.norm();
+    if (std::abs(queryNorm) < 1e-8) {
+        queryNorm = 1;
+    }
+    std::vector<real> table(pq_.nsubq() * ProductQuantizer::ksub());
+    pq_.distanceTable(query.data(), table.data());
+
+    Predictions heap;
+    heap.reserve(k + 1);
+    for (int64_t i = 0; i < m_; i++) {
+        if (i == banId || norms_[i] < 1e-8) {
+            continue;
+        }
+        real score = pq_.score(table.data(), codes_.data() + i * pq_.nsubq()) /
+                (norms_[i] * queryNorm);
+        if (heap.size() == k && score <= heap.front().first) {
+            continue;
+        }
+        heap.push_back(std::make_pair(score, int32_t(i)));
+        std::push_heap(heap.begin(), heap.end(), compareScores);
+        if (heap.size() > k) {
+            std::pop_heap(heap.begin(), heap.end(), compareScores);
+            heap.pop_back();
+        }
+    }
+    std::sort_heap(heap.begin(), heap.end(), compareScores);
+    return heap;
+}
+
+void QuantMatrix::save(std::ostream& out) const {
+    out.write((char*)&m_, sizeof(int64_t));
+    out.write((char*)&n_, sizeof(int64_t));
+    pq_.save(out);
+    out.write((char*)codes_.data(), codes_.size() * sizeof(uint8_t));
+    out.write((char*)norms_.data(), norms_.size() * sizeof(real));
+}
+
+void QuantMatrix::load(std::istream& in) {
+    in.read((char*)&m_, sizeof(int64_t));
+    in.read((char*)&n_, sizeof(int64_t));
+    pq_.load(in);
+    codes_.resize(m_ * pq_.nsubq());
+    norms_.resize(m_);
+    in.read((char*)codes_.data(), codes_.size() * sizeof(uint8_t));
+    in.read((char*)norms_.data(), norms_.size() * sizeof(real));
+}
+
+} // namespace word2vec
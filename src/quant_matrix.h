@@ -0,0 +1,61 @@
+//
+// Created by fengjiaxin on 2023/5/20.
+// 乘积量化之后的矩阵, 每行只存 nsubq 个字节的编码和解码向量的模长
+
+#ifndef WORD2VEC_QUANT_MATRIX_H
+#define WORD2VEC_QUANT_MATRIX_H
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "matrix.h"
+#include "product_quantizer.h"
+#include "real.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include "vector.h"
+
+namespace word2vec {
+
+class QuantMatrix {
+private:
+    int64_t m_;
+    int64_t n_;
+    ProductQuantizer pq_;
+    std::vector<uint8_t> codes_;
+    std::vector<real> norms_; // 解码之后的模长, 算余弦相似度用
+
+public:
+    QuantMatrix();
+
+    // 在 mat 的所有行上训练量化器, 然后给每一行编码
+    QuantMatrix(
+            const Matrix& mat,
+            int32_t dsub,
+            int32_t thread,
+            int32_t seed,
+            ThreadPool& pool);
+
+    inline int64_t rows() const {
+        return m_;
+    }
+
+    inline int64_t cols() const {
+        return n_;
+    }
+
+    void addRowToVector(Vector& x, int64_t i) const;
+
+    // 和 query 余弦相似度最大的 k 行, 用非对称距离表, 不解码任何一行
+    Predictions topK(const Vector& query, int32_t k, int32_t banId) const;
+
+    void save(std::ostream&) const;
+
+    void load(std::istream&);
+};
+
+} // namespace word2vec
+
+#endif //WORD2VEC_QUANT_MATRIX_H
@@ -5,8 +5,13 @@
 #ifndef WORD2VEC_REAL_H
 #define WORD2VEC_REAL_H
 
+#include <cstdint>
+
 namespace word2vec {
     typedef float real;
+
+    // 矩阵的存储精度, 半精度只用来存储, 计算都转成 real
+    enum class dtype_name : int { fp32 = 1, fp16, bf16 };
 }
 
 #endif //WORD2VEC_REAL_H
@@ -0,0 +1,67 @@
+//
+// Created by fengjiaxin on 2023/5/12.
+// 每个训练线程独立持有的轻量随机数发生器
+
+#ifndef WORD2VEC_RNG_H
+#define WORD2VEC_RNG_H
+
+#include <cstdint>
+#include <limits>
+
+namespace word2vec {
+
+// splitmix64, 用于把 seed 打散成互不相关的初始状态
+inline uint64_t splitmix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// xorshift64*, 满足 UniformRandomBitGenerator, 可以直接用于 std 的分布
+class XorShiftRng {
+private:
+    uint64_t state_;
+
+public:
+    typedef uint64_t result_type;
+
+    explicit XorShiftRng(uint64_t seed = 0) : state_(splitmix64(seed)) {
+        if (state_ == 0) {
+            state_ = 0x9E3779B97F4A7C15ULL; // xorshift 的状态不能为 0
+        }
+    }
+
+    static constexpr result_type min() {
+        return 0;
+    }
+
+    static constexpr result_type max() {
+        return std::numeric_limits<result_type>::max();
+    }
+
+    inline result_type operator()() {
+        state_ ^= state_ >> 12;
+        state_ ^= state_ << 25;
+        state_ ^= state_ >> 27;
+        return state_ * 0x2545F4914F6CDD1DULL;
+    }
+
+    // checkpoint 保存和恢复用
+    inline uint64_t state() const {
+        return state_;
+    }
+
+    inline void setState(uint64_t state) {
+        state_ = state;
+    }
+
+    // [0, 1) 之间的浮点数, 取高 24 位
+    inline float uniform() {
+        return float((*this)() >> 40) * (1.0f / 16777216.0f);
+    }
+};
+
+} // namespace word2vec
+
+#endif //WORD2VEC_RNG_H
@@ -0,0 +1,108 @@
+//
+// Created by fengjiaxin on 2023/5/16.
+//
+
+#include "search.h"
+#include "kernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+
+namespace word2vec {
+
+namespace {
+
+const int64_t QUERY_BLOCK = 32;
+const int64_t L2_BYTES = 256 * 1024;
+
+bool compareScores(
+        const std::pair<real, int32_t>& l,
+        const std::pair<real, int32_t>& r) {
+    return l.first > r.first;
+}
+
+inline void pushTopK(Predictions& heap, int32_t k, real score, int32_t id) {
+    if (heap.size() == k && score <= heap.front().first) {
+        return;
+    }
+    heap.push_back(std::make_pair(score, id));
+    std::push_heap(heap.begin(), heap.end(), compareScores);
+    if (heap.size() > k) {
+        std::pop_heap(heap.begin(), heap.end(), compareScores);
+        heap.pop_back();
+    }
+}
+
+// 一个查询块对全部行: 按行分块, 保证一块行向量留在 L2 里被这一批查询重复使用
+void searchBlock(
+        const Matrix& vectors,
+        const Matrix& queries,
+        int64_t qbegin,
+        int64_t qend,
+        int32_t k,
+        const std::vector<int32_t>& ban,
+        std::vector<Predictions>& results) {
+    const int64_t dim = vectors.cols();
+    const int64_t n = vectors.rows();
+    const int64_t rowBlock =
+            std::max<int64_t>(16, L2_BYTES / (vectors.stride() * int64_t(sizeof(real))));
+    std::vector<real> scores((qend - qbegin) * rowBlock);
+
+    for (int64_t rbegin = 0; rbegin < n; rbegin += rowBlock) {
+        int64_t rend = std::min(n, rbegin + rowBlock);
+        for (int64_t q = qbegin; q < qend; q++) {
+            const real* query = queries.row(q);
+            real* s = scores.data() + (q - qbegin) * rowBlock;
+            for (int64_t r = rbegin; r < rend; r++) {
+                s[r - rbegin] = kernels::dot(query, vectors.row(r), dim);
+            }
+        }
+        for (int64_t q = qbegin; q < qend; q++) {
+            const real* s = scores.data() + (q - qbegin) * rowBlock;
+            int32_t banned = ban.empty() ? -1 : ban[q];
+            for (int64_t r = rbegin; r < rend; r++) {
+                if (r != banned) {
+                    pushTopK(results[q], k, s[r - rbegin], r);
+                }
+            }
+        }
+    }
+    for (int64_t q = qbegin; q < qend; q++) {
+        std::sort_heap(results[q].begin(), results[q].end(), compareScores);
+    }
+}
+
+} // namespace
+
+std::vector<Predictions> exactTopK(
+        const Matrix& vectors,
+        const Matrix& queries,
+        int32_t k,
+        const std::vector<int32_t>& ban,
+        int32_t thread,
+        ThreadPool& pool) {
+    assert(vectors.cols() == queries.cols());
+    assert(ban.empty() || ban.size() == queries.rows());
+    const int64_t nqueries = queries.rows();
+    std::vector<Predictions> results(nqueries);
+    if (k <= 0) {
+        // 堆为空时 pushTopK 不能访问堆顶
+        return results;
+    }
+    for (auto& heap : results) {
+        heap.reserve(k + 1);
+    }
+
+    std::atomic<int64_t> next(0);
+    pool.run(thread, [&](int32_t) {
+        int64_t qbegin;
+        while ((qbegin = next.fetch_add(QUERY_BLOCK)) < nqueries) {
+            int64_t qend = std::min(nqueries, qbegin + QUERY_BLOCK);
+            searchBlock(vectors, queries, qbegin, qend, k, ban, results);
+        }
+    });
+    return results;
+}
+
+} // namespace word2vec
@@ -0,0 +1,29 @@
+//
+// Created by fengjiaxin on 2023/5/16.
+// 精确的批量 top k 查询: 查询矩阵和词向量矩阵分块相乘, 多线程, 全程只用整数 id
+
+#ifndef WORD2VEC_SEARCH_H
+#define WORD2VEC_SEARCH_H
+
+#include <vector>
+
+#include "matrix.h"
+#include "real.h"
+#include "thread_pool.h"
+#include "utils.h"
+
+namespace word2vec {
+
+// 返回每个查询(queries 的一行)与 vectors 所有行内积最大的 k 个 (内积, 行号), 从大到小排列
+// ban[q] >= 0 时, 第 q 个查询的结果里不包含这一行(通常是查询词自己)
+std::vector<Predictions> exactTopK(
+        const Matrix& vectors,
+        const Matrix& queries,
+        int32_t k,
+        const std::vector<int32_t>& ban,
+        int32_t thread,
+        ThreadPool& pool);
+
+} // namespace word2vec
+
+#endif //WORD2VEC_SEARCH_H
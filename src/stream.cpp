@@ -0,0 +1,159 @@
+//
+// Created by fengjiaxin on 2023/5/21.
+//
+
+#include "stream.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <istream>
+#include <stdexcept>
+#include <streambuf>
+
+namespace word2vec {
+
+// 直接读文件描述符的 streambuf: 先 poll 等数据, 每 100ms 检查一次 stop,
+// 管道的写端一直不写也不关闭时读线程照样可以退出
+class FdBuffer : public std::streambuf {
+private:
+    static const int POLL_MILLIS = 100;
+
+    int fd_;
+    std::atomic<bool> stopped_;
+    char data_[1 << 16];
+
+public:
+    explicit FdBuffer(int fd) : fd_(fd), stopped_(false) {}
+
+    void stop() {
+        stopped_ = true;
+    }
+
+protected:
+    int_type underflow() override {
+        while (!stopped_) {
+            struct pollfd pfd = {fd_, POLLIN, 0};
+            int ready = poll(&pfd, 1, POLL_MILLIS);
+            if (ready < 0 && errno != EINTR) {
+                return traits_type::eof();
+            }
+            if (ready <= 0) {
+                continue;
+            }
+            ssize_t n = ::read(fd_, data_, sizeof(data_));
+            if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            }
+            if (n <= 0) {
+                return traits_type::eof();
+            }
+            setg(data_, data_, data_ + n);
+            return traits_type::to_int_type(data_[0]);
+        }
+        return traits_type::eof();
+    }
+};
+
+const size_t TokenStream::MAX_CHUNK;
+const size_t TokenStream::MIN_CHUNK;
+
+TokenStream::TokenStream(
+        std::shared_ptr<const Dictionary> dict,
+        const std::string& filename,
+        int32_t thread)
+        : dict_(dict),
+          fd_(STDIN_FILENO),
+          chunk_(std::max(MIN_CHUNK, MAX_CHUNK / std::max(thread, 1))),
+          slots_(4 * std::max(thread, 1)),
+          head_(0),
+          count_(0),
+          eof_(false),
+          stopped_(false),
+          ntokens_(0) {
+    if (filename != "-") {
+        // 和 ifstream 一样, 命名管道在有写端打开之前会阻塞在这里
+        fd_ = open(filename.c_str(), O_RDONLY);
+        if (fd_ < 0) {
+            throw std::invalid_argument(filename + " cannot be opened for training!");
+        }
+    }
+    buffer_.reset(new FdBuffer(fd_));
+    reader_ = std::thread([this]() { read(); });
+}
+
+TokenStream::~TokenStream() {
+    stop();
+    if (fd_ != STDIN_FILENO) {
+        close(fd_);
+    }
+}
+
+bool TokenStream::isStream(const std::string& filename) {
+    if (filename == "-") {
+        return true;
+    }
+    struct stat st;
+    return stat(filename.c_str(), &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+void TokenStream::read() {
+    std::istream in(buffer_.get());
+    dict_->encode(
+            in, [this](std::vector<int32_t>& buffer) { return push(buffer); }, chunk_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    eof_ = true;
+    notEmpty_.notify_all();
+}
+
+bool TokenStream::push(std::vector<int32_t>& buffer) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    notFull_.wait(lock, [this]() { return count_ < slots_.size() || stopped_; });
+    if (stopped_) {
+        return false;
+    }
+    ntokens_ += buffer.size();
+    slots_[(head_ + count_) % slots_.size()].swap(buffer);
+    count_++;
+    notEmpty_.notify_one();
+    return true;
+}
+
+bool TokenStream::pop(std::vector<int32_t>& chunk) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    notEmpty_.wait(lock, [this]() { return count_ > 0 || eof_ || stopped_; });
+    if (count_ == 0 || stopped_) {
+        return false;
+    }
+    chunk.swap(slots_[head_]);
+    head_ = (head_ + 1) % slots_.size();
+    count_--;
+    notFull_.notify_one();
+    return true;
+}
+
+void TokenStream::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
+        notEmpty_.notify_all();
+        notFull_.notify_all();
+    }
+    // 读线程最多等一个 poll 周期就会看到 stop
+    buffer_->stop();
+    if (reader_.joinable()) {
+        reader_.join();
+    }
+}
+
+int64_t TokenStream::ntokens() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return ntokens_;
+}
+
+} // namespace word2vec
@@ -0,0 +1,67 @@
+//
+// Created by fengjiaxin on 2023/5/21.
+// 从 stdin 或者管道流式训练: 一个读线程分词, 把 id 块放进有界环形缓冲区, 训练线程从里面取
+
+#ifndef WORD2VEC_STREAM_H
+#define WORD2VEC_STREAM_H
+
+#include <condition_variable>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dictionary.h"
+
+namespace word2vec {
+
+class FdBuffer;
+
+class TokenStream {
+private:
+    static const size_t MAX_CHUNK = 1 << 16;
+    static const size_t MIN_CHUNK = 1 << 12;
+
+    std::shared_ptr<const Dictionary> dict_;
+    int fd_; // 命名管道或者标准输入
+    std::unique_ptr<FdBuffer> buffer_; // 等待输入时定期检查 stop, 不会一直阻塞在 read 上
+    size_t chunk_;
+    std::thread reader_;
+
+    std::mutex mutex_;
+    std::condition_variable notEmpty_;
+    std::condition_variable notFull_;
+    std::vector<std::vector<int32_t>> slots_; // 环形缓冲区, 每个槽位是一块 id
+    size_t head_; // 下一个要取的槽位
+    size_t count_; // 已经填好的槽位数
+    bool eof_;
+    bool stopped_;
+    int64_t ntokens_; // 读到的 id 个数, 包括句子结束符
+
+    void read();
+    bool push(std::vector<int32_t>&);
+
+public:
+    // filename 为 "-" 时读标准输入; 每个训练线程在缓冲区里最多有 4 块,
+    // 块的大小随线程数减小, 数据少或者来得慢的流也能分给所有线程
+    TokenStream(
+            std::shared_ptr<const Dictionary>,
+            const std::string& filename,
+            int32_t thread);
+    ~TokenStream();
+
+    // 判断输入是否只能顺序读一遍, 这种输入不能按位置切分给线程
+    static bool isStream(const std::string&);
+
+    // 取下一块放到 chunk 里, 原来的内容交还给缓冲区复用; 流读完并且缓冲区空了返回 false
+    bool pop(std::vector<int32_t>& chunk);
+    // 训练提前结束时让读线程退出
+    void stop();
+    int64_t ntokens();
+};
+
+} // namespace word2vec
+
+#endif //WORD2VEC_STREAM_H
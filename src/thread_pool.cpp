@@ -0,0 +1,153 @@
+//
+// Created by fengjiaxin on 2023/5/24.
+//
+
+#include "thread_pool.h"
+
+#include <stdexcept>
+
+namespace word2vec {
+
+const int32_t ThreadPool::MAX_THREADS;
+
+TaskGroup::TaskGroup() : pending_(0) {}
+
+void TaskGroup::add() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_++;
+}
+
+void TaskGroup::finish(std::exception_ptr error) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (error && !error_) {
+        error_ = error;
+    }
+    if (--pending_ == 0) {
+        done_.notify_all();
+    }
+}
+
+void TaskGroup::wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this]() { return pending_ == 0; });
+    if (error_) {
+        std::exception_ptr error = error_;
+        error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+bool TaskGroup::waitFor(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return done_.wait_for(lock, timeout, [this]() { return pending_ == 0; });
+}
+
+ThreadPool::ThreadPool() : size_(0), pending_(0), active_(0), next_(0), stop_(false) {
+    workers_.reserve(MAX_THREADS);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        wake_.notify_all();
+    }
+    for (auto& worker : workers_) {
+        worker->thread.join();
+    }
+}
+
+int32_t ThreadPool::size() const {
+    return size_;
+}
+
+void ThreadPool::reserve(int32_t n) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    n = std::min(n, MAX_THREADS);
+    while (int32_t(workers_.size()) < n) {
+        int32_t id = workers_.size();
+        workers_.emplace_back(new Worker());
+        workers_.back()->thread = std::thread([this, id]() { loop(id); });
+        size_++;
+    }
+}
+
+void ThreadPool::submit(TaskGroup& group, std::function<void()> task) {
+    if (size_ == 0) {
+        throw std::logic_error("ThreadPool has no threads!");
+    }
+    group.add();
+    Worker& worker = *workers_[next_++ % size_];
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.tasks.emplace_back([&group, task]() {
+            std::exception_ptr error;
+            try {
+                task();
+            } catch (...) {
+                error = std::current_exception();
+            }
+            group.finish(error);
+        });
+    }
+    pending_++;
+    std::lock_guard<std::mutex> lock(mutex_);
+    wake_.notify_one();
+}
+
+void ThreadPool::run(int32_t n, const std::function<void(int32_t)>& fn) {
+    if (n <= 1) {
+        // webassembly can't instantiate `std::thread`
+        fn(0);
+        return;
+    }
+    // 正在执行的任务可能也在等这一批, 新任务需要另外的线程
+    reserve(active_ + pending_ + n);
+    TaskGroup group;
+    for (int32_t i = 0; i < n; i++) {
+        submit(group, [&fn, i]() { fn(i); });
+    }
+    group.wait();
+}
+
+// 先取自己队列的头部, 没有时从其他队列的尾部偷
+bool ThreadPool::pop(int32_t id, std::function<void()>& task) {
+    const int32_t size = size_;
+    for (int32_t k = 0; k < size; k++) {
+        Worker& worker = *workers_[(id + k) % size];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.tasks.empty()) {
+            continue;
+        }
+        if (k == 0) {
+            task = std::move(worker.tasks.front());
+            worker.tasks.pop_front();
+        } else {
+            task = std::move(worker.tasks.back());
+            worker.tasks.pop_back();
+        }
+        pending_--;
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::loop(int32_t id) {
+    std::function<void()> task;
+    while (true) {
+        if (pop(id, task)) {
+            active_++;
+            task();
+            task = nullptr;
+            active_--;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this]() { return stop_ || pending_ > 0; });
+        if (stop_) {
+            return;
+        }
+    }
+}
+
+} // namespace word2vec
@@ -0,0 +1,85 @@
+//
+// Created by fengjiaxin on 2023/5/24.
+// Word2Vec 持有的线程池: 初始化、训练、预计算词向量和批量近邻查询共用同一批线程
+
+#ifndef WORD2VEC_THREAD_POOL_H
+#define WORD2VEC_THREAD_POOL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace word2vec {
+
+// 一批任务的完成计数, 最后一个任务结束时唤醒等待的线程
+class TaskGroup {
+private:
+    friend class ThreadPool;
+
+    std::mutex mutex_;
+    std::condition_variable done_;
+    int64_t pending_;
+    std::exception_ptr error_;
+
+    void add();
+    void finish(std::exception_ptr error);
+
+public:
+    TaskGroup();
+
+    // 等所有任务结束, 有任务抛出异常时重新抛出第一个
+    void wait();
+    // 最多等 timeout, 返回任务是否已经全部结束
+    bool waitFor(std::chrono::milliseconds timeout);
+};
+
+// 每个线程有自己的任务队列, 提交时轮流放入, 空闲的线程从别的队列尾部偷任务.
+// 线程数按需增长, 保证每批任务提交时都有足够的空闲线程, 需要同时运行的任务(比如训练线程)不会互相等待
+class ThreadPool {
+private:
+    static const int32_t MAX_THREADS = 1024;
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers_; // 预留 MAX_THREADS, 增长时已有的元素不会移动
+    std::atomic<int32_t> size_;
+    std::atomic<int64_t> pending_; // 已提交还没开始的任务
+    std::atomic<int64_t> active_; // 正在执行的任务
+    std::atomic<uint32_t> next_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stop_;
+
+    void loop(int32_t id);
+    bool pop(int32_t id, std::function<void()>& task);
+
+public:
+    ThreadPool();
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int32_t size() const;
+    // 保证至少有 n 个线程
+    void reserve(int32_t n);
+    // 异步执行 task, 结束时记到 group 上; 调用方负责保证线程足够
+    void submit(TaskGroup& group, std::function<void()> task);
+    // 同时执行 fn(0) ... fn(n - 1), 全部结束后返回; n <= 1 时直接在当前线程执行
+    void run(int32_t n, const std::function<void(int32_t)>& fn);
+};
+
+} // namespace word2vec
+
+#endif //WORD2VEC_THREAD_POOL_H
@@ -3,7 +3,15 @@
 //
 
 #include "utils.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <iomanip>
 #include <ios>
+#include <new>
+#include <stdexcept>
 
 namespace word2vec {
 
@@ -19,6 +27,53 @@ void seek(std::ifstream& ifs, int64_t pos) {
     ifs.seekg(std::streampos(pos));
 }
 
+int64_t pad(std::ostream& out, int64_t alignment) {
+    int64_t pos = out.tellp();
+    while (pos % alignment != 0) {
+        out.put(0);
+        pos++;
+    }
+    return pos;
+}
+
+std::shared_ptr<void> mapFile(const std::string& filename, int64_t& size, bool writable) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::invalid_argument(filename + " cannot be opened for mapping!");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::invalid_argument(filename + " cannot be opened for mapping!");
+    }
+    size = st.st_size;
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    int flags = writable ? MAP_PRIVATE : MAP_SHARED;
+    void* addr = mmap(nullptr, size > 0 ? size : 1, prot, flags, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error(filename + " cannot be mapped!");
+    }
+    size_t length = size > 0 ? size : 1;
+    return std::shared_ptr<void>(addr, [length](void* p) { munmap(p, length); });
+}
+
+std::shared_ptr<void> allocAligned(int64_t bytes, bool hugePages) {
+    const int64_t HUGE_PAGE_SIZE = 2 << 20;
+    size_t alignment = hugePages && bytes >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : 64;
+    void* addr = nullptr;
+    if (posix_memalign(&addr, alignment, bytes > 0 ? bytes : 1) != 0) {
+        throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    if (alignment == HUGE_PAGE_SIZE) {
+        // 只是建议, 内核不支持或者关闭了透明大页时忽略失败
+        madvise(addr, bytes, MADV_HUGEPAGE);
+    }
+#endif
+    return std::shared_ptr<void>(addr, free);
+}
+
 double getDuration(
         const std::chrono::steady_clock::time_point& start,
         const std::chrono::steady_clock::time_point& end) {
@@ -9,7 +9,9 @@
 #include <algorithm>
 #include <chrono>
 #include <fstream>
+#include <memory>
 #include <ostream>
+#include <string>
 #include <vector>
 
 namespace word2vec {
@@ -22,6 +24,17 @@ int64_t size(std::ifstream&);
 
 void seek(std::ifstream&, int64_t);
 
+// 写 0 直到输出位置是 alignment 的整数倍, 返回对齐之后的位置
+int64_t pad(std::ostream&, int64_t alignment);
+
+// 把整个文件映射到内存, 返回的指针析构时 munmap
+// writable 时是写时复制的私有映射, 没有被写过的页在进程之间共享
+std::shared_ptr<void> mapFile(const std::string& filename, int64_t& size, bool writable);
+
+// 按 64 字节对齐分配, hugePages 时大块内存按 2M 对齐并用 madvise 请求透明大页
+// 返回的内存没有初始化, 析构时 free
+std::shared_ptr<void> allocAligned(int64_t bytes, bool hugePages);
+
 double getDuration(
         const std::chrono::steady_clock::time_point& start,
         const std::chrono::steady_clock::time_point& end);
@@ -4,8 +4,12 @@
 
 #include "word2vec.h"
 #include "loss.h"
+#include "search.h"
 
 #include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdio>
 #include <iomanip>
 #include <iostream>
 #include <numeric>
@@ -18,11 +22,37 @@
 namespace word2vec {
 
 const int32_t WORD2VEC_FILEFORMAT_MAGIC_INT32 = 793712314;
-
-bool comparePairs(
-        const std::pair<real, std::string>& l,
-        const std::pair<real, std::string>& r) {
-    return l.first > r.first;
+// 可以 mmap 的模型格式: 矩阵按页对齐, 加载时直接映射而不是拷贝
+const int32_t WORD2VEC_MAPPED_MAGIC_INT32 = 793712317;
+const int32_t WORD2VEC_MAPPED_VERSION = 4;
+// 版本 3 的头只有两个矩阵, 仍然可以读
+const int32_t WORD2VEC_MAPPED_MIN_VERSION = 3;
+const int64_t WORD2VEC_PAGE_SIZE = 4096;
+// 乘积量化之后的模型, 只有 input 的编码
+const int32_t WORD2VEC_QUANT_MAGIC_INT32 = 793712318;
+const int32_t WORD2VEC_QUANT_VERSION = 1;
+
+// 映射格式的文件头, 紧跟在 magic 和 version 之后
+struct MappedHeader {
+    int64_t inputRows;
+    int64_t inputCols;
+    int64_t inputOffset;
+    int64_t outputRows;
+    int64_t outputCols;
+    int64_t outputOffset;
+    // 预计算的归一化词向量(fp32), 没有保存时 vectorsRows 为 0
+    int64_t vectorsRows;
+    int64_t vectorsCols;
+    int64_t vectorsOffset;
+};
+
+// 版本 3 的头到 vectorsRows 之前为止, 读进来之后预计算词向量的字段是 0
+static MappedHeader readHeader(std::istream& in, int32_t version) {
+    MappedHeader header = {};
+    const size_t size =
+            version < 4 ? offsetof(MappedHeader, vectorsRows) : sizeof(MappedHeader);
+    in.read((char*)&header, size);
+    return header;
 }
 
 std::shared_ptr<Loss> Word2Vec::createLoss(std::shared_ptr<Matrix>& output) {
@@ -31,16 +61,27 @@ std::shared_ptr<Loss> Word2Vec::createLoss(std::shared_ptr<Matrix>& output) {
         case loss_name::ns:
             return std::make_shared<NegativeSamplingLoss>(
                     output, args_->neg, getIds(), getTargetCounts());
+        case loss_name::hs:
+            return std::make_shared<HierarchicalSoftmaxLoss>(
+                    output, getTargetCounts());
         default:
             throw std::runtime_error("Unknown loss");
     }
 }
 
 Word2Vec::Word2Vec()
-        : wordVectors_(nullptr), trainException_(nullptr) {}
+        : quant_(false),
+          trainTokens_(0),
+          wordVectors_(nullptr),
+          trainException_(nullptr),
+          resumeTokenCount_(0) {}
 
 void Word2Vec::addInputVector(Vector& vec, int32_t ind) const {
-    vec.addRow(*input_, ind);
+    if (quant_) {
+        qinput_->addRowToVector(vec, ind);
+    } else {
+        vec.addRow(*input_, ind);
+    }
 }
 
 std::shared_ptr<const Dictionary> Word2Vec::getDictionary() const {
@@ -111,34 +152,81 @@ void Word2Vec::saveOutput(const std::string& filename) {
     ofs.close();
 }
 
-bool Word2Vec::checkModel(std::istream& in) {
+bool Word2Vec::checkModel(std::istream& in, int32_t& version) {
     int32_t magic;
     in.read((char*)&(magic), sizeof(int32_t));
-    if (magic != WORD2VEC_FILEFORMAT_MAGIC_INT32) {
+    if (magic != WORD2VEC_MAPPED_MAGIC_INT32) {
         return false;
     }
-    return true;
+    in.read((char*)&(version), sizeof(int32_t));
+    return version >= WORD2VEC_MAPPED_MIN_VERSION && version <= WORD2VEC_MAPPED_VERSION;
 }
 
 void Word2Vec::signModel(std::ostream& out) {
-    const int32_t magic = WORD2VEC_FILEFORMAT_MAGIC_INT32;
+    const int32_t magic = WORD2VEC_MAPPED_MAGIC_INT32;
+    const int32_t version = WORD2VEC_MAPPED_VERSION;
     out.write((char*)&(magic), sizeof(int32_t));
+    out.write((char*)&(version), sizeof(int32_t));
 }
 
-void Word2Vec::saveModel(const std::string& filename) {
-    std::ofstream ofs(filename, std::ofstream::binary);
-    if (!ofs.is_open()) {
-        throw std::invalid_argument(filename + " cannot be opened for saving!");
+void Word2Vec::saveModel(const std::string& filename, bool withVectors, int32_t thread) {
+    if (quant_) {
+        std::ofstream ofs(filename, std::ofstream::binary);
+        if (!ofs.is_open()) {
+            throw std::invalid_argument(filename + " cannot be opened for saving!");
+        }
+        saveQuantModel(ofs);
+        ofs.close();
+        return;
     }
     if (!input_ || !output_) {
         throw std::runtime_error("Model never trained");
     }
-    signModel(ofs);
-    args_->save(ofs);
-    dict_->save(ofs);
-    input_->save(ofs);
-    output_->save(ofs);
+    if (withVectors) {
+        lazyComputeWordVectors(thread);
+    }
+    // 先写临时文件再改名, 覆盖正在映射的模型文件(比如 precompute 自己)时不会把映射截断
+    const std::string tmpname = filename + ".tmp";
+    std::ofstream ofs(tmpname, std::ofstream::binary);
+    if (!ofs.is_open()) {
+        throw std::invalid_argument(tmpname + " cannot be opened for saving!");
+    }
+    saveMapped(ofs, *input_, *output_, withVectors ? wordVectors_.get() : nullptr);
     ofs.close();
+    if (!ofs || std::rename(tmpname.c_str(), filename.c_str()) != 0) {
+        throw std::runtime_error(filename + " cannot be saved!");
+    }
+}
+
+void Word2Vec::saveMapped(
+        std::ostream& out,
+        const Matrix& input,
+        const Matrix& output,
+        const Matrix* vectors) {
+    MappedHeader header = {};
+    signModel(out);
+    out.write((char*)&header, sizeof(MappedHeader));
+    args_->save(out);
+    dict_->savePrebuilt(out);
+
+    header.inputRows = input.rows();
+    header.inputCols = input.cols();
+    header.inputOffset = utils::pad(out, WORD2VEC_PAGE_SIZE);
+    input.saveData(out);
+    header.outputRows = output.rows();
+    header.outputCols = output.cols();
+    header.outputOffset = utils::pad(out, WORD2VEC_PAGE_SIZE);
+    output.saveData(out);
+    if (vectors) {
+        header.vectorsRows = vectors->rows();
+        header.vectorsCols = vectors->cols();
+        header.vectorsOffset = utils::pad(out, WORD2VEC_PAGE_SIZE);
+        vectors->saveData(out);
+    }
+
+    out.seekp(2 * sizeof(int32_t));
+    out.write((char*)&header, sizeof(MappedHeader));
+    out.seekp(0, std::ios::end);
 }
 
 void Word2Vec::loadModel(const std::string& filename) {
@@ -146,13 +234,127 @@ void Word2Vec::loadModel(const std::string& filename) {
     if (!ifs.is_open()) {
         throw std::invalid_argument(filename + " cannot be opened for loading!");
     }
-    if (!checkModel(ifs)) {
+    int32_t magic = 0;
+    ifs.read((char*)&(magic), sizeof(int32_t));
+    ifs.seekg(0);
+    int32_t version = 0;
+    if (checkModel(ifs, version)) {
+        mapModel(filename, ifs, version);
+    } else if (magic == WORD2VEC_QUANT_MAGIC_INT32) {
+        ifs.seekg(sizeof(int32_t));
+        loadQuantModel(ifs);
+    } else if (magic == WORD2VEC_FILEFORMAT_MAGIC_INT32) {
+        // 旧格式的模型, 整个读进内存
+        ifs.seekg(sizeof(int32_t));
+        loadModel(ifs);
+    } else {
         throw std::invalid_argument(filename + " has wrong file format!");
     }
-    loadModel(ifs);
     ifs.close();
 }
 
+void Word2Vec::saveQuantModel(std::ostream& out) {
+    const int32_t magic = WORD2VEC_QUANT_MAGIC_INT32;
+    const int32_t version = WORD2VEC_QUANT_VERSION;
+    out.write((char*)&(magic), sizeof(int32_t));
+    out.write((char*)&(version), sizeof(int32_t));
+    args_->save(out);
+    dict_->savePrebuilt(out);
+    qinput_->save(out);
+}
+
+void Word2Vec::loadQuantModel(std::istream& in) {
+    int32_t version;
+    in.read((char*)&(version), sizeof(int32_t));
+    if (version != WORD2VEC_QUANT_VERSION) {
+        throw std::invalid_argument("Unsupported quantized model version!");
+    }
+    index_.reset();
+    wordVectors_.reset();
+    input_.reset();
+    output_.reset();
+    model_.reset();
+    args_ = std::make_shared<Args>();
+    args_->load(in);
+    dict_ = std::make_shared<Dictionary>(args_);
+    dict_->loadPrebuilt(in);
+    qinput_ = std::make_shared<QuantMatrix>();
+    qinput_->load(in);
+    quant_ = true;
+}
+
+void Word2Vec::quantize(const Args& qargs) {
+    if (quant_) {
+        throw std::invalid_argument("Model is already quantized!");
+    }
+    if (!input_) {
+        throw std::runtime_error("Model never trained");
+    }
+    index_.reset();
+    wordVectors_.reset();
+    qinput_ = std::make_shared<QuantMatrix>(*input_, qargs.dsub, qargs.thread, args_->seed, pool_);
+    quant_ = true;
+    input_.reset();
+    output_.reset();
+    model_.reset();
+}
+
+bool Word2Vec::isQuant() const {
+    return quant_;
+}
+
+// 参数和词典整块读进内存(和词表大小成正比, 但不重新 hash); 只有矩阵映射到内存, 不拷贝
+void Word2Vec::mapModel(const std::string& filename, std::istream& in, int32_t version) {
+    index_.reset();
+    wordVectors_.reset();
+    qinput_.reset();
+    quant_ = false;
+    MappedHeader header = readHeader(in, version);
+    args_ = std::make_shared<Args>();
+    args_->load(in);
+    dict_ = std::make_shared<Dictionary>(args_);
+    dict_->loadPrebuilt(in);
+
+    int64_t size;
+    std::shared_ptr<void> mapping = utils::mapFile(filename, size, true);
+    const int64_t elementSize =
+            args_->dtype == dtype_name::fp32 ? sizeof(real) : sizeof(uint16_t);
+    if (header.inputOffset + header.inputRows * header.inputCols * elementSize > size ||
+        header.outputOffset + header.outputRows * header.outputCols * elementSize > size ||
+        header.vectorsOffset + header.vectorsRows * header.vectorsCols * int64_t(sizeof(real)) > size) {
+        throw std::invalid_argument(filename + " is truncated!");
+    }
+    char* base = static_cast<char*>(mapping.get());
+    input_ = mapMatrix(header.inputRows, header.inputCols, base + header.inputOffset, mapping);
+    output_ = mapMatrix(header.outputRows, header.outputCols, base + header.outputOffset, mapping);
+    if (header.vectorsRows > 0) {
+        if (header.vectorsRows != dict_->nwords() || header.vectorsCols != args_->dim) {
+            throw std::invalid_argument(filename + " has mismatched word vectors!");
+        }
+        // 查询时直接用文件里的归一化词向量, 不再重新计算
+        wordVectors_.reset(new Matrix(
+                header.vectorsRows,
+                header.vectorsCols,
+                reinterpret_cast<real*>(base + header.vectorsOffset),
+                mapping));
+    }
+
+    buildModel();
+}
+
+std::shared_ptr<Matrix> Word2Vec::mapMatrix(
+        int64_t rows,
+        int64_t cols,
+        char* data,
+        std::shared_ptr<void> mapping) const {
+    if (args_->dtype == dtype_name::fp32) {
+        return std::make_shared<Matrix>(
+                rows, cols, reinterpret_cast<real*>(data), mapping);
+    }
+    return std::make_shared<Matrix>(
+            rows, cols, reinterpret_cast<uint16_t*>(data), args_->dtype, mapping);
+}
+
 std::vector<int32_t> Word2Vec::getTargetCounts() const {
     return dict_->getCounts();
 }
@@ -168,10 +370,14 @@ void Word2Vec::buildModel() {
 }
 
 void Word2Vec::loadModel(std::istream& in) {
+    index_.reset();
+    wordVectors_.reset();
+    qinput_.reset();
+    quant_ = false;
     args_ = std::make_shared<Args>();
     input_ = std::make_shared<Matrix>();
     output_ = std::make_shared<Matrix>();
-    args_->load(in);
+    args_->loadLegacy(in);
     dict_ = std::make_shared<Dictionary>(args_, in);
 
     input_->load(in);
@@ -187,9 +393,11 @@ std::tuple<int64_t, double, double> Word2Vec::progressInfo(real progress) {
 
     int64_t eta = 2592000; // Default to one month in seconds (720 * 3600)
 
-    if (progress > 0 && t >= 0) {
-        eta = t * (1 - progress) / progress;
-        wst = double(tokenCount_) / t / args_->thread;
+    // 从 checkpoint 恢复时只用这次运行的进度估计速度
+    double resumed = double(resumeTokenCount_) / (args_->epoch * trainTokens_);
+    if (progress > resumed && t >= 0) {
+        eta = t * (1 - progress) / (progress - resumed);
+        wst = double(tokenCount_ - resumeTokenCount_) / t / args_->thread;
     }
 
     return std::tuple<double, double, int64_t>(wst, lr, eta);
@@ -234,39 +442,49 @@ void Word2Vec::skipgram(
         Model::State& state,
         real lr,
         const std::vector<int32_t>& line) {
+    std::vector<int32_t> sg(1);
+    std::vector<int32_t> contexts;
     int32_t boundary = args_->ws;
     for (int32_t w = 0; w < line.size(); w++) {
-        std::vector<int32_t> sg;
-        sg.push_back(line[w]);
+        sg[0] = line[w];
+        contexts.clear();
         for (int32_t c = -boundary; c <= boundary; c++) {
             if (c != 0 && w + c >= 0 && w + c < line.size()) {
-                model_->update(sg, line, w + c, lr, state);
+                contexts.push_back(w + c);
             }
         }
+        // 中心词的向量只取一次, 整个窗口的梯度累加之后一次写回
+        model_->update(sg, line, contexts, lr, state);
     }
 }
 
 
 
 
-void Word2Vec::precomputeWordVectors(Matrix& wordVectors) {
-    Vector vec(args_->dim);
-    wordVectors.zero();
-    for (int32_t i = 0; i < dict_->nwords(); i++) {
-        std::string word = dict_->getWord(i);
-        getWordVector(vec, word);
-        real norm = vec.norm();
-        if (norm > 0) {
-            wordVectors.addVectorToRow(vec, i, 1.0 / norm);
+// 按行号直接取 input 的行归一化, 不经过词的字符串和 hash 查找
+void Word2Vec::precomputeWordVectors(Matrix& wordVectors, int32_t thread) {
+    const int64_t nwords = dict_->nwords();
+    const int64_t dim = args_->dim;
+    pool_.run(thread, [&](int32_t t) {
+        Vector vec(dim);
+        for (int64_t i = nwords * t / thread; i < nwords * (t + 1) / thread; i++) {
+            vec.zero();
+            addInputVector(vec, i);
+            real norm = vec.norm();
+            real scale = norm > 0 ? 1.0 / norm : 0.0;
+            real* row = wordVectors.row(i);
+            for (int64_t j = 0; j < dim; j++) {
+                row[j] = vec[j] * scale;
+            }
         }
-    }
+    });
 }
 
-void Word2Vec::lazyComputeWordVectors() {
+void Word2Vec::lazyComputeWordVectors(int32_t thread) {
     if (!wordVectors_) {
         wordVectors_ = std::unique_ptr<Matrix>(
                 new Matrix(dict_->nwords(), args_->dim));
-        precomputeWordVectors(*wordVectors_);
+        precomputeWordVectors(*wordVectors_, thread);
     }
 }
 
@@ -277,90 +495,534 @@ std::vector<std::pair<real, std::string>> Word2Vec::getNN(
 
     getWordVector(query, word);
 
-    lazyComputeWordVectors();
+    if (quant_) {
+        // 直接在编码上查表, 不需要解码出整个词向量矩阵
+        std::vector<std::pair<real, std::string>> result;
+        for (const auto& item : qinput_->topK(query, k, getWordId(word))) {
+            result.emplace_back(item.first, dict_->getWord(item.second));
+        }
+        return result;
+    }
+    // 单个查询没有线程数, 用参数里的 -thread
+    lazyComputeWordVectors(args_->thread);
     assert(wordVectors_);
-    return getNN(*wordVectors_, query, k, {word});
+    return getNN(*wordVectors_, query, k, getWordId(word));
+}
+
+std::vector<std::pair<real, std::string>> Word2Vec::getNN(
+        const std::string& word,
+        int32_t k,
+        int32_t ef) {
+    if (!index_) {
+        return getNN(word, k);
+    }
+    Vector query(args_->dim);
+    getWordVector(query, word);
+    real queryNorm = query.norm();
+    if (std::abs(queryNorm) > 1e-8) {
+        query.mul(1.0 / queryNorm);
+    }
+
+    int32_t id = getWordId(word);
+    std::vector<std::pair<real, std::string>> result;
+    for (const auto& item : index_->search(query.data(), k + 1, ef)) {
+        if (item.second != id && result.size() < k) {
+            result.emplace_back(item.first, dict_->getWord(item.second));
+        }
+    }
+    return result;
+}
+
+void Word2Vec::buildIndex(int32_t M, int32_t efConstruction, int32_t thread) {
+    lazyComputeWordVectors(thread);
+    index_.reset(new HnswIndex(*wordVectors_, M, efConstruction, thread, pool_));
+}
+
+void Word2Vec::saveIndex(const std::string& filename) {
+    if (!index_) {
+        throw std::runtime_error("Index never built");
+    }
+    std::ofstream ofs(filename, std::ofstream::binary);
+    if (!ofs.is_open()) {
+        throw std::invalid_argument(filename + " cannot be opened for saving!");
+    }
+    index_->save(ofs);
+    ofs.close();
+}
+
+void Word2Vec::loadIndex(const std::string& filename) {
+    std::ifstream ifs(filename, std::ifstream::binary);
+    if (!ifs.is_open()) {
+        throw std::invalid_argument(filename + " cannot be opened for loading!");
+    }
+    lazyComputeWordVectors(args_->thread);
+    index_.reset(new HnswIndex(*wordVectors_, ifs));
+    ifs.close();
 }
 
 std::vector<std::pair<real, std::string>> Word2Vec::getNN(
         const Matrix& wordVectors,
         const Vector& query,
         int32_t k,
-        const std::set<std::string>& banSet) {
-    std::vector<std::pair<real, std::string>> heap;
-
+        int32_t banId) {
     real queryNorm = query.norm();
     if (std::abs(queryNorm) < 1e-8) {
         queryNorm = 1;
     }
+    Matrix queries(1, query.size());
+    for (int64_t j = 0; j < query.size(); j++) {
+        queries.at(0, j) = query[j] / queryNorm;
+    }
 
-    for (int32_t i = 0; i < dict_->nwords(); i++) {
-        std::string word = dict_->getWord(i);
-        if (banSet.find(word) == banSet.end()) {
-            real dp = wordVectors.dotRow(query, i);
-            real similarity = dp / queryNorm;
+    // 整个扫描只用整数 id, 最后才转成字符串
+    std::vector<Predictions> found = exactTopK(wordVectors, queries, k, {banId}, 1, pool_);
+    std::vector<std::pair<real, std::string>> result;
+    for (const auto& item : found[0]) {
+        result.emplace_back(item.first, dict_->getWord(item.second));
+    }
+    return result;
+}
 
-            if (heap.size() == k && similarity < heap.front().first) {
-                continue;
-            }
-            heap.push_back(std::make_pair(similarity, word));
-            std::push_heap(heap.begin(), heap.end(), comparePairs);
-            if (heap.size() > k) {
-                std::pop_heap(heap.begin(), heap.end(), comparePairs);
-                heap.pop_back();
-            }
+std::vector<Predictions> Word2Vec::getNN(
+        const Matrix& queries,
+        int32_t k,
+        const std::vector<int32_t>& banIds,
+        int32_t thread) {
+    assert(queries.cols() == args_->dim);
+    lazyComputeWordVectors(thread);
+    Matrix normalized(queries);
+    for (int64_t i = 0; i < normalized.rows(); i++) {
+        real norm = 0.0;
+        for (int64_t j = 0; j < normalized.cols(); j++) {
+            norm += normalized.at(i, j) * normalized.at(i, j);
+        }
+        norm = std::sqrt(norm);
+        if (norm < 1e-8) {
+            continue;
+        }
+        for (int64_t j = 0; j < normalized.cols(); j++) {
+            normalized.at(i, j) /= norm;
         }
     }
-    std::sort_heap(heap.begin(), heap.end(), comparePairs);
+    return exactTopK(*wordVectors_, normalized, k, banIds, thread, pool_);
+}
 
-    return heap;
+void Word2Vec::saveNN(std::ostream& out, int32_t k, int32_t thread) {
+    lazyComputeWordVectors(thread);
+    const int64_t batch = 4096;
+    const int64_t dim = args_->dim;
+    const int32_t nwords = dict_->nwords();
+    for (int32_t begin = 0; begin < nwords; begin += batch) {
+        int32_t end = std::min<int64_t>(nwords, begin + batch);
+        // 词向量已经归一化, 直接作为查询
+        Matrix queries(end - begin, dim, wordVectors_->row(begin));
+        std::vector<int32_t> banIds(end - begin);
+        std::iota(banIds.begin(), banIds.end(), begin);
+        std::vector<Predictions> results =
+                exactTopK(*wordVectors_, queries, k, banIds, thread, pool_);
+        for (int32_t i = begin; i < end; i++) {
+            out << dict_->getWord(i);
+            for (const auto& item : results[i - begin]) {
+                out << " " << dict_->getWord(item.second) << " " << item.first;
+            }
+            out << "\n";
+        }
+    }
+    out << std::flush;
 }
 
 
+// 等到训练线程全部结束或者超时, 返回训练线程是否已经全部结束
+bool Word2Vec::waitTraining(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(trainMutex_);
+    return trainCv_.wait_for(
+            lock, timeout, [this]() { return finishedThreads_ >= args_->thread; });
+}
+
 bool Word2Vec::keepTraining(const int64_t ntokens) const {
-    return tokenCount_ < args_->epoch * ntokens && !trainException_;
+    return tokenCount_ < args_->epoch * ntokens && !trainException_ &&
+            finishedThreads_ < args_->thread;
 }
 
 void Word2Vec::trainThread(int32_t threadId) {
-    std::ifstream ifs(args_->input);
-    utils::seek(ifs, threadId * utils::size(ifs) / args_->thread);
-
-    Model::State state(args_->dim, output_->size(0));
+    // 多进程训练时每个进程只读自己那一段语料
+    const int32_t shard = args_->rank * args_->thread + threadId;
+    const int32_t nshards = args_->world * args_->thread;
+    std::ifstream ifs;
+    int64_t begin = 0;
+    int64_t end = 0;
+    int64_t pos = 0;
+    if (corpus_) {
+        corpus_->shard(shard, nshards, begin, end);
+        pos = begin;
+    } else if (!stream_) {
+        ifs.open(args_->input);
+        utils::seek(ifs, shard * utils::size(ifs) / nshards);
+    }
+    // 线程池的线程会被复用, 训练结束时恢复原来的 affinity
+    std::unique_ptr<ScopedPin> pin;
+    if (numa_ && args_->thread > 1) {
+        pin.reset(new ScopedPin(*numa_, threadId, args_->thread));
+    }
+    std::vector<int32_t> chunk; // 流式训练时当前在用的 id 块
+    int64_t chunkPos = 0;
+
+    Model::State state(args_->dim, output_->size(0), threadId + args_->seed);
+    state.profile = metrics_ != nullptr;
+    if (!resumeStates_.empty()) {
+        // 接着 checkpoint 里的位置和随机数继续
+        if (corpus_) {
+            pos = resumeStates_[threadId].pos;
+        } else {
+            utils::seek(ifs, resumeStates_[threadId].pos);
+        }
+        state.rng.setState(resumeStates_[threadId].rng);
+    }
+    int64_t publishedGeneration = 0;
 
-    const int64_t ntokens = dict_->ntokens();
+    const int64_t ntokens = trainTokens_;
     int64_t localTokenCount = 0;
+    int64_t threadTokenCount = 0;
+    int64_t readNanos = 0;
+    int64_t updateNanos = 0;
+    std::chrono::steady_clock::time_point t0, t1, t2;
     std::vector<int32_t> line;
     try {
         while (keepTraining(ntokens)) {
             real progress = real(tokenCount_) / (args_->epoch * ntokens);
             real lr = args_->lr * (1.0 - progress);
+            if (state.profile) {
+                t0 = std::chrono::steady_clock::now();
+            }
+            if (corpus_) {
+                localTokenCount += corpus_->getLine(pos, begin, end, line, state.rng);
+            } else if (stream_) {
+                if (chunkPos >= int64_t(chunk.size())) {
+                    if (!stream_->pop(chunk)) {
+                        break;
+                    }
+                    chunkPos = 0;
+                }
+                localTokenCount += dict_->getLine(
+                        chunk.data(), chunkPos, chunk.size(), line, state.rng);
+            } else {
+                localTokenCount += dict_->getLine(ifs, line, state.rng);
+            }
+            if (state.profile) {
+                t1 = std::chrono::steady_clock::now();
+            }
             if (args_->model == model_name::cbow) {
-                localTokenCount += dict_->getLine(ifs, line);
                 cbow(state, lr, line);
             } else if (args_->model == model_name::sg) {
-                localTokenCount += dict_->getLine(ifs, line);
                 skipgram(state, lr, line);
             }
+            if (state.profile) {
+                t2 = std::chrono::steady_clock::now();
+                readNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+                updateNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count();
+            }
             if (localTokenCount > args_->lrUpdateRate) {
                 tokenCount_ += localTokenCount;
+                threadTokenCount += localTokenCount;
                 localTokenCount = 0;
                 if (threadId == 0 && args_->verbose > 1) {
                     loss_ = state.getLoss();
                 }
+                if (checkpointGeneration_.load(std::memory_order_relaxed) > publishedGeneration) {
+                    publishedGeneration = checkpointGeneration_;
+                    int64_t offset = corpus_ ? pos : int64_t(ifs.tellg());
+                    publishCheckpoint(threadId, std::max<int64_t>(offset, 0), state.rng);
+                }
+                if (metrics_) {
+                    publishMetrics(threadId, threadTokenCount, readNanos, updateNanos, state);
+                    if (threadId == 0) {
+                        metrics_->maybeWrite(progress, lr);
+                    }
+                }
             }
         }
     } catch (Matrix::EncounteredNaNError&) {
         trainException_ = std::current_exception();
     }
-    if (threadId == 0)
+    // 流式训练时 0 号线程可能一块也没分到, 这时用其他线程的损失
+    if (state.getNExamples() > 0 && (threadId == 0 || loss_ < 0)) {
         loss_ = state.getLoss();
+    }
+    if (metrics_) {
+        publishMetrics(
+                threadId, threadTokenCount + localTokenCount, readNanos, updateNanos, state);
+    }
     ifs.close();
+    std::lock_guard<std::mutex> lock(trainMutex_);
+    finishedThreads_++;
+    trainCv_.notify_all();
+}
+
+void Word2Vec::publishMetrics(
+        int32_t threadId,
+        int64_t tokens,
+        int64_t readNanos,
+        int64_t updateNanos,
+        const Model::State& state) {
+    TrainMetrics::ThreadStats& stats = metrics_->stats(threadId);
+    stats.tokens.store(tokens, std::memory_order_relaxed);
+    stats.examples.store(state.getNExamples(), std::memory_order_relaxed);
+    stats.readNanos.store(readNanos, std::memory_order_relaxed);
+    // 负采样发生在 update 里面, 这里把它拆出来
+    stats.updateNanos.store(updateNanos - state.sampleNanos, std::memory_order_relaxed);
+    stats.sampleNanos.store(state.sampleNanos, std::memory_order_relaxed);
+    if (state.getNExamples() > 0) {
+        stats.loss.store(state.getLoss(), std::memory_order_relaxed);
+    }
+}
+
+void Word2Vec::publishCheckpoint(int32_t threadId, int64_t pos, const XorShiftRng& rng) {
+    std::lock_guard<std::mutex> lock(checkpointMutex_);
+    threadStates_[threadId].pos = pos;
+    threadStates_[threadId].rng = rng.state();
+    threadStates_[threadId].generation = checkpointGeneration_;
+    checkpointCv_.notify_all();
+}
+
+// rank 0 负责汇总, 其他进程每隔 syncInterval 秒同步一次, 最后一轮在训练线程结束之后做
+void Word2Vec::syncThread() {
+    try {
+        if (sync_->isMaster()) {
+            sync_->serve();
+            return;
+        }
+        const int64_t ntokens = trainTokens_;
+        const std::chrono::seconds interval(args_->syncInterval);
+        while (!waitTraining(interval) && keepTraining(ntokens)) {
+            sync_->sync(false);
+        }
+    } catch (std::runtime_error&) {
+        trainException_ = std::current_exception();
+    }
+}
+
+// 定期请求每个线程发布自己的位置, 拷贝一份矩阵之后在这个线程里写文件, 训练线程不用等写盘
+void Word2Vec::checkpointThread() {
+    const int64_t ntokens = trainTokens_;
+    const std::chrono::seconds interval(args_->checkpoint);
+    while (!waitTraining(interval) && keepTraining(ntokens)) {
+        int64_t generation = ++checkpointGeneration_;
+        std::unique_lock<std::mutex> lock(checkpointMutex_);
+        bool ready = false;
+        while (!ready && keepTraining(ntokens)) {
+            ready = std::all_of(
+                    threadStates_.begin(), threadStates_.end(),
+                    [generation](const ThreadCheckpoint& item) {
+                        return item.generation == generation;
+                    });
+            if (!ready) {
+                checkpointCv_.wait_for(lock, std::chrono::milliseconds(100));
+            }
+        }
+        lock.unlock();
+        if (!ready) {
+            break;
+        }
+        try {
+            saveCheckpoint(args_->output + ".ckpt");
+        } catch (const std::exception& e) {
+            // 写不了 checkpoint 不影响训练本身
+            std::cerr << "Checkpoint failed: " << e.what() << std::endl;
+        }
+    }
+}
+
+// checkpoint 是一个完整的映射格式模型, 后面跟着训练进度, 先写临时文件再改名
+void Word2Vec::saveCheckpoint(const std::string& filename) {
+    std::vector<ThreadCheckpoint> states;
+    int64_t tokenCount;
+    {
+        std::lock_guard<std::mutex> lock(checkpointMutex_);
+        states = threadStates_;
+        tokenCount = tokenCount_;
+    }
+    // 拷贝时训练线程还在写, 和 hogwild 一样容忍这一点不一致
+    Matrix input(*input_);
+    Matrix output(*output_);
+
+    std::string tmpname = filename + ".tmp";
+    std::ofstream ofs(tmpname, std::ofstream::binary);
+    if (!ofs.is_open()) {
+        throw std::invalid_argument(tmpname + " cannot be opened for saving!");
+    }
+    saveMapped(ofs, input, output, nullptr);
+    int32_t thread = states.size();
+    ofs.write((char*)&trainTokens_, sizeof(int64_t));
+    ofs.write((char*)&tokenCount, sizeof(int64_t));
+    ofs.write((char*)&thread, sizeof(int32_t));
+    for (const auto& item : states) {
+        ofs.write((char*)&item.pos, sizeof(int64_t));
+        ofs.write((char*)&item.rng, sizeof(uint64_t));
+    }
+    ofs.close();
+    if (std::rename(tmpname.c_str(), filename.c_str()) != 0) {
+        throw std::runtime_error(filename + " cannot be replaced!");
+    }
+}
+
+bool Word2Vec::loadCheckpoint(const std::string& filename) {
+    std::ifstream ifs(filename, std::ifstream::binary);
+    if (!ifs.is_open()) {
+        return false;
+    }
+    int32_t version = 0;
+    if (!checkModel(ifs, version)) {
+        throw std::invalid_argument(filename + " has wrong file format!");
+    }
+    MappedHeader header = readHeader(ifs, version);
+    Args saved;
+    saved.load(ifs);
+    if (saved.dim != args_->dim || saved.dtype != args_->dtype ||
+        saved.model != args_->model || saved.loss != args_->loss) {
+        throw std::invalid_argument(filename + " does not match the training arguments!");
+    }
+    dict_ = std::make_shared<Dictionary>(args_);
+    dict_->loadPrebuilt(ifs);
+
+    input_ = std::make_shared<Matrix>(
+            header.inputRows, header.inputCols, true, true, args_->dtype);
+    ifs.seekg(header.inputOffset);
+    input_->loadData(ifs);
+    output_ = std::make_shared<Matrix>(
+            header.outputRows, header.outputCols, true, true, args_->dtype);
+    ifs.seekg(header.outputOffset);
+    output_->loadData(ifs);
+
+    int32_t thread = 0;
+    ifs.read((char*)&trainTokens_, sizeof(int64_t));
+    ifs.read((char*)&resumeTokenCount_, sizeof(int64_t));
+    ifs.read((char*)&thread, sizeof(int32_t));
+    resumeStates_.resize(thread);
+    for (auto& item : resumeStates_) {
+        ifs.read((char*)&item.pos, sizeof(int64_t));
+        ifs.read((char*)&item.rng, sizeof(uint64_t));
+    }
+    if (!ifs) {
+        throw std::invalid_argument(filename + " is truncated!");
+    }
+    if (thread != args_->thread) {
+        // 线程数变了, 分片也变了, 只能从各分片开头重新读, 学习率仍然接着走
+        resumeStates_.clear();
+    }
+    return true;
+}
+
+// 增量训练: 读入旧模型的词典和矩阵, grow 时用新数据扩充词典, 新词的行追加在矩阵末尾
+void Word2Vec::loadPretrained(const std::string& filename, bool grow) {
+    std::ifstream ifs(filename, std::ifstream::binary);
+    if (!ifs.is_open()) {
+        throw std::invalid_argument(filename + " cannot be opened for loading!");
+    }
+    int32_t magic = 0;
+    ifs.read((char*)&(magic), sizeof(int32_t));
+    ifs.seekg(0);
+    // 旧格式(magic 793712314): 参数只有 8 个字段, 词典逐个词存储, 矩阵紧跟在后面
+    const bool legacy = magic == WORD2VEC_FILEFORMAT_MAGIC_INT32;
+    int32_t version = 0;
+    MappedHeader header = {};
+    Args saved;
+    if (legacy) {
+        ifs.seekg(sizeof(int32_t));
+        saved.loadLegacy(ifs);
+    } else if (checkModel(ifs, version)) {
+        header = readHeader(ifs, version);
+        saved.load(ifs);
+    } else {
+        throw std::invalid_argument(filename + " has wrong file format!");
+    }
+    if (saved.loss != args_->loss) {
+        throw std::invalid_argument(filename + " was trained with a different loss!");
+    }
+    // 维数和精度是矩阵本身的属性, 跟着旧模型走
+    args_->dim = saved.dim;
+    args_->dtype = saved.dtype;
+    if (legacy) {
+        dict_ = std::make_shared<Dictionary>(args_, ifs);
+    } else {
+        dict_ = std::make_shared<Dictionary>(args_);
+        dict_->loadPrebuilt(ifs);
+    }
+    const int32_t oldWords = dict_->nwords();
+    if (grow) {
+        trainTokens_ = dict_->extend(args_->input, args_->thread, pool_);
+    }
+    const int32_t nwords = dict_->nwords();
+
+    // 旧格式的矩阵前面是行数和列数, 新格式按头里的偏移找
+    auto loadMatrix = [&](int64_t rows, int64_t cols, int64_t offset) {
+        if (legacy) {
+            ifs.read((char*)&rows, sizeof(int64_t));
+            ifs.read((char*)&cols, sizeof(int64_t));
+        } else {
+            ifs.seekg(offset);
+        }
+        if (!ifs) {
+            throw std::invalid_argument(filename + " is truncated!");
+        }
+        std::shared_ptr<Matrix> matrix =
+                std::make_shared<Matrix>(rows, cols, true, true, args_->dtype);
+        matrix->loadData(ifs);
+        matrix->resizeRows(nwords, true);
+        return matrix;
+    };
+    input_ = loadMatrix(header.inputRows, header.inputCols, header.inputOffset);
+    output_ = loadMatrix(header.outputRows, header.outputCols, header.outputOffset);
+    if (!ifs) {
+        throw std::invalid_argument(filename + " is truncated!");
+    }
+    if (args_->loss == loss_name::hs) {
+        // 词频变了, Huffman 树整个重建, 旧的内部节点向量没有意义
+        output_->zero();
+    }
+
+    // 新词和从头训练一样初始化: input 用同样的 uniformRows 分块随机, output 为 0
+    const int64_t added = nwords - oldWords;
+    const int32_t thread = args_->thread;
+    pool_.run(thread, [&](int32_t i) {
+        input_->uniformRows(
+                1.0 / args_->dim,
+                oldWords + added * i / thread,
+                oldWords + added * (i + 1) / thread,
+                args_->seed);
+    });
+}
+
+// 只取模型或者编码语料里的词典, 词表在训练中不再变化
+void Word2Vec::loadVocab(const std::string& filename) {
+    if (Corpus::isEncoded(filename)) {
+        dict_ = Corpus(args_, filename).getDictionary();
+        return;
+    }
+    std::ifstream ifs(filename, std::ifstream::binary);
+    if (!ifs.is_open()) {
+        throw std::invalid_argument(filename + " cannot be opened for loading!");
+    }
+    int32_t version = 0;
+    if (!checkModel(ifs, version)) {
+        throw std::invalid_argument(filename + " has wrong file format!");
+    }
+    // 只要词典, 头和参数读过去跳过
+    readHeader(ifs, version);
+    Args saved;
+    saved.load(ifs);
+    dict_ = std::make_shared<Dictionary>(args_);
+    dict_->loadPrebuilt(ifs);
 }
 
-std::shared_ptr<Matrix> Word2Vec::createRandomMatrix() const {
+std::shared_ptr<Matrix> Word2Vec::createRandomMatrix() {
+    // 训练时按行随机读写, 每行对齐到 cache line, 大矩阵用透明大页
     std::shared_ptr<Matrix> input = std::make_shared<Matrix>(
-            dict_->nwords(), args_->dim);
-    input->uniform(1.0 / args_->dim, args_->thread, args_->seed);
+            dict_->nwords(), args_->dim, true, true, args_->dtype);
+    const int64_t m = input->size(0);
+    const int32_t thread = args_->thread;
+    pool_.run(thread, [&](int32_t i) {
+        input->uniformRows(1.0 / args_->dim, m * i / thread, m * (i + 1) / thread, args_->seed);
+    });
 
     return input;
 }
@@ -368,62 +1030,180 @@ std::shared_ptr<Matrix> Word2Vec::createRandomMatrix() const {
 std::shared_ptr<Matrix> Word2Vec::createTrainOutputMatrix() const {
     int64_t m = dict_->nwords();
     std::shared_ptr<Matrix> output =
-            std::make_shared<Matrix>(m, args_->dim);
+            std::make_shared<Matrix>(m, args_->dim, true, true, args_->dtype);
     output->zero();
 
     return output;
 }
 
 void Word2Vec::train(const Args& args) {
+    index_.reset();
+    wordVectors_.reset();
+    qinput_.reset();
+    quant_ = false;
+    stream_.reset();
+    sync_.reset();
     args_ = std::make_shared<Args>(args);
-    dict_ = std::make_shared<Dictionary>(args_);
-    if (args_->input == "-") {
-        // manage expectations
-        throw std::invalid_argument("Cannot use stdin for training!");
+    resumeTokenCount_ = 0;
+    resumeStates_.clear();
+    bool resumed = false;
+    if (!args_->vocab.empty() && !TokenStream::isStream(args_->input)) {
+        throw std::invalid_argument("-vocab is only used when training from stdin or a pipe!");
     }
-    std::ifstream ifs(args_->input);
-    if (!ifs.is_open()) {
-        throw std::invalid_argument(
-                args_->input + " cannot be opened for training!");
+    if (args_->world > 1 && (args_->resume || args_->checkpoint > 0)) {
+        throw std::invalid_argument("Checkpoints are not supported with -world > 1!");
+    }
+    if (TokenStream::isStream(args_->input)) {
+        if (args_->world > 1) {
+            throw std::invalid_argument("Training from stdin or a pipe needs -world 1!");
+        }
+        // 流只能读一遍: 没法按位置恢复, 词典也没法先统计
+        if (args_->resume || args_->checkpoint > 0) {
+            throw std::invalid_argument("Checkpoints need a seekable input!");
+        }
+        corpus_ = nullptr;
+        if (!args_->pretrained.empty()) {
+            loadPretrained(args_->pretrained, false);
+        } else if (!args_->vocab.empty()) {
+            loadVocab(args_->vocab);
+        } else {
+            throw std::invalid_argument("Training from stdin or a pipe needs -vocab or -pretrained!");
+        }
+        // 流的长度事先不知道, 学习率按估计的词数衰减, 读到流结束或者词数用完为止
+        args_->epoch = 1;
+        trainTokens_ = args_->streamTokens > 0 ? args_->streamTokens : dict_->ntokens();
+        stream_.reset(new TokenStream(dict_, args_->input, args_->thread));
+    } else if (Corpus::isEncoded(args_->input)) {
+        if (!args_->pretrained.empty()) {
+            // 编码语料里的 id 属于 encode 时的词典, 和旧模型的词典对不上
+            throw std::invalid_argument("Incremental training needs a text input!");
+        }
+        // 词典在 encode 的时候已经生成
+        corpus_ = std::make_shared<Corpus>(args_, args_->input);
+        dict_ = corpus_->getDictionary();
+        trainTokens_ = dict_->ntokens();
+        resumed = args_->resume && loadCheckpoint(args_->output + ".ckpt");
+    } else {
+        corpus_ = nullptr;
+        resumed = args_->resume && loadCheckpoint(args_->output + ".ckpt");
+        if (!resumed && !args_->pretrained.empty()) {
+            loadPretrained(args_->pretrained, true);
+        } else if (!resumed) {
+            dict_ = std::make_shared<Dictionary>(args_);
+            dict_->readFromFile(args_->input, args_->thread, pool_);
+            trainTokens_ = dict_->ntokens();
+        }
     }
-    dict_->readFromFile(ifs);
-    ifs.close();
 
-    input_ = createRandomMatrix();
-    output_ = createTrainOutputMatrix();
+    if (!resumed && args_->pretrained.empty()) {
+        input_ = createRandomMatrix();
+        output_ = createTrainOutputMatrix();
+    } else if (resumed && args_->verbose > 0) {
+        std::cerr << "Resume from " << args_->output << ".ckpt at "
+                  << resumeTokenCount_ << " words" << std::endl;
+    }
 
+    if (args_->world > 1) {
+        // 词典由每个进程各自从完整语料统计, 结果一致; 每个进程只训练自己的分片
+        trainTokens_ = (trainTokens_ + args_->world - 1) / args_->world;
+        sync_.reset(new ParameterSync(args_, input_, output_));
+    }
+    numa_.reset();
+    if (args_->numa != numa_mode::none) {
+        // 线程按编号连续分到各个节点, 分片也是连续的, 每个节点读相邻的一段语料
+        numa_.reset(new NumaTopology(NumaTopology::detect()));
+        bool interleave = args_->numa == numa_mode::interleave;
+        input_->distribute(*numa_, interleave);
+        output_->distribute(*numa_, interleave);
+        if (args_->verbose > 0) {
+            std::cerr << "NUMA nodes: " << numa_->nodes() << " ("
+                      << args_->numaToString(args_->numa) << ")" << std::endl;
+        }
+    }
     auto loss = createLoss(output_);
     model_ = std::make_shared<Model>(input_, output_, loss);
+    metrics_.reset();
+    if (!args_->metrics.empty()) {
+        metrics_.reset(new TrainMetrics(
+                args_->metrics, args_->thread, args_->metricsInterval));
+    }
     startThreads();
+    if (stream_) {
+        if (args_->verbose > 0) {
+            std::cerr << "Read " << stream_->ntokens() << " ids from " << args_->input
+                      << std::endl;
+        }
+        stream_.reset();
+    }
+    if (sync_) {
+        if (args_->verbose > 0) {
+            std::cerr << "Synchronized " << sync_->rounds() << " rounds, " << sync_->rows()
+                      << " rows" << std::endl;
+        }
+        sync_.reset();
+    }
+    if (metrics_) {
+        metrics_->write(1.0, 0.0, "end");
+        metrics_.reset();
+    }
+}
+
+void Word2Vec::encode(const Args& args) {
+    args_ = std::make_shared<Args>(args);
+    dict_ = std::make_shared<Dictionary>(args_);
+    std::ifstream ifs(args_->input);
+    if (!ifs.is_open()) {
+        throw std::invalid_argument(
+                args_->input + " cannot be opened for encoding!");
+    }
+    dict_->readFromFile(args_->input, args_->thread, pool_);
+    Corpus::encode(*dict_, ifs, args_->output);
+    ifs.close();
 }
 
 // 真正意义上的开始训练
 void Word2Vec::startThreads() {
-    start_ = std::chrono::steady_clock::now();
-    tokenCount_ = 0;
+    tokenCount_ = resumeTokenCount_;
     loss_ = -1.0;
     trainException_ = nullptr;
-    std::vector<std::thread> threads;
+    finishedThreads_ = 0;
+    threadStates_.assign(args_->thread, ThreadCheckpoint{0, 0, 0});
+    checkpointGeneration_ = 0;
+    // 训练线程之外, checkpoint 和参数同步各占一个线程, 和训练线程同时运行
+    const int32_t services = (args_->checkpoint > 0) + (sync_ != nullptr);
+    pool_.reserve(services + (args_->thread > 1 ? args_->thread : 0));
+    // 线程已经创建好, 从这里开始计时, 不含词典统计、矩阵初始化和线程启动
+    start_ = std::chrono::steady_clock::now();
+    TaskGroup background;
+    if (args_->checkpoint > 0) {
+        pool_.submit(background, [this]() { checkpointThread(); });
+    }
+    if (sync_) {
+        pool_.submit(background, [this]() { syncThread(); });
+    }
+    TaskGroup training;
     if (args_->thread > 1) {
         for (int32_t i = 0; i < args_->thread; i++) {
-            threads.emplace_back([=]() { trainThread(i); });
+            pool_.submit(training, [this, i]() { trainThread(i); });
         }
     } else {
         // webassembly can't instantiate `std::thread`
         trainThread(0);
     }
-    const int64_t ntokens = dict_->ntokens();
-    // Same condition as trainThread
-    while (keepTraining(ntokens)) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));// 是为了打印整体训练信息
+    const int64_t ntokens = trainTokens_;
+    // 训练线程全部结束时立刻返回, 否则每 100ms 打印一次整体训练信息
+    while (!training.waitFor(std::chrono::milliseconds(100))) {
         if (loss_ >= 0 && args_->verbose > 1) {
             real progress = real(tokenCount_) / (args_->epoch * ntokens);
             std::cerr << "\r";
             printInfo(progress, loss_, std::cerr);
         }
     }
-    for (int32_t i = 0; i < threads.size(); i++) {
-        threads[i].join();
+    training.wait();
+    trainSeconds_ = utils::getDuration(start_, std::chrono::steady_clock::now());
+    background.wait();
+    if (sync_ && !sync_->isMaster() && !trainException_) {
+        sync_->sync(true);
     }
     if (trainException_) {
         std::exception_ptr exception = trainException_;
@@ -441,6 +1221,10 @@ int Word2Vec::getDimension() const {
     return args_->dim;
 }
 
+double Word2Vec::getTrainSeconds() const {
+    return trainSeconds_;
+}
+
 
 
 
@@ -10,18 +10,28 @@
 
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <queue>
 #include <set>
 #include <tuple>
 
 #include "args.h"
+#include "corpus.h"
 #include "matrix.h"
 #include "dictionary.h"
+#include "distributed.h"
+#include "hnsw.h"
+#include "metrics.h"
 #include "model.h"
+#include "numa.h"
+#include "quant_matrix.h"
 #include "real.h"
+#include "stream.h"
+#include "thread_pool.h"
 #include "utils.h"
 #include "vector.h"
 
@@ -32,28 +42,81 @@ class Word2Vec {
 private:
     std::shared_ptr<Args> args_;
     std::shared_ptr<Dictionary> dict_;
+    std::shared_ptr<Corpus> corpus_; // 输入是 encode 之后的语料时才有
+    std::unique_ptr<TokenStream> stream_; // 从 stdin 或管道训练时才有
+    std::unique_ptr<ParameterSync> sync_; // 多进程训练时才有
+    std::unique_ptr<NumaTopology> numa_; // -numa 不是 none 时才有
     std::shared_ptr<Matrix> input_;
     std::shared_ptr<Matrix> output_;
     std::shared_ptr<Model> model_;
+    std::shared_ptr<QuantMatrix> qinput_; // 量化之后只保留 input 的编码
+    bool quant_;
     std::atomic<int64_t> tokenCount_{};
+    int64_t trainTokens_; // 每个 epoch 要训练的词数, 增量训练时只有新数据的词数
     std::atomic<real> loss_{};
     std::chrono::steady_clock::time_point start_;
+    double trainSeconds_ = 0; // 最近一次训练线程从开始到全部结束的时间
     std::unique_ptr<Matrix> wordVectors_;
+    std::unique_ptr<HnswIndex> index_; // 引用 wordVectors_, 声明在它之后保证先析构
     std::exception_ptr trainException_;
+    std::atomic<int32_t> finishedThreads_{}; // 流读完时训练线程会提前退出
+
+    // 每个线程的读取位置和随机数状态, checkpoint 时由线程自己发布
+    struct ThreadCheckpoint {
+        int64_t pos;
+        uint64_t rng;
+        int64_t generation;
+    };
+    std::vector<ThreadCheckpoint> threadStates_;
+    std::vector<ThreadCheckpoint> resumeStates_; // 从 checkpoint 恢复时每个线程的起点
+    int64_t resumeTokenCount_;
+    std::atomic<int64_t> checkpointGeneration_{};
+    std::mutex checkpointMutex_;
+    std::condition_variable checkpointCv_;
+    std::unique_ptr<TrainMetrics> metrics_; // 指定 -metrics 时才有
+    std::mutex trainMutex_;
+    std::condition_variable trainCv_; // 训练线程全部结束时通知
+    ThreadPool pool_; // 训练、初始化、预计算词向量和批量查询共用
 
     void signModel(std::ostream&);
-    bool checkModel(std::istream&);
+    bool checkModel(std::istream&, int32_t& version);
+    void mapModel(const std::string& filename, std::istream& in, int32_t version);
+    void saveQuantModel(std::ostream& out);
+    void saveMapped(
+            std::ostream& out,
+            const Matrix& input,
+            const Matrix& output,
+            const Matrix* vectors);
+    void publishCheckpoint(int32_t threadId, int64_t pos, const XorShiftRng& rng);
+    void checkpointThread();
+    void syncThread();
+    void saveCheckpoint(const std::string& filename);
+    bool loadCheckpoint(const std::string& filename);
+    void loadPretrained(const std::string& filename, bool grow);
+    void loadVocab(const std::string& filename);
+    void loadQuantModel(std::istream& in);
+    std::shared_ptr<Matrix> mapMatrix(
+            int64_t rows,
+            int64_t cols,
+            char* data,
+            std::shared_ptr<void> mapping) const;
     void startThreads();
     void addInputVector(Vector&, int32_t) const;
     void trainThread(int32_t);
+    void publishMetrics(
+            int32_t threadId,
+            int64_t tokens,
+            int64_t readNanos,
+            int64_t updateNanos,
+            const Model::State& state);
     std::vector<std::pair<real, std::string>> getNN(
             const Matrix& wordVectors,
             const Vector& queryVec,
             int32_t k,
-            const std::set<std::string>& banSet);
-    void lazyComputeWordVectors();
+            int32_t banId);
+    void lazyComputeWordVectors(int32_t thread);
     void printInfo(real, real, std::ostream&);
-    std::shared_ptr<Matrix> createRandomMatrix() const;
+    std::shared_ptr<Matrix> createRandomMatrix();
     std::shared_ptr<Matrix> createTrainOutputMatrix() const;
     std::vector<int32_t> getTargetCounts() const;
     std::vector<int32_t> getIds() const;
@@ -62,8 +125,9 @@ private:
     void cbow(Model::State& state, real lr, const std::vector<int32_t>& line);
     void skipgram(Model::State& state, real lr, const std::vector<int32_t>& line);
 
-    void precomputeWordVectors(Matrix& wordVectors);
+    void precomputeWordVectors(Matrix& wordVectors, int32_t thread);
     bool keepTraining(int64_t ntokens) const;
+    bool waitTraining(std::chrono::milliseconds timeout);
     void buildModel();
     std::tuple<int64_t, double, double> progressInfo(real progress);
 
@@ -89,7 +153,9 @@ public:
 
     void saveVectors(const std::string& filename);
 
-    void saveModel(const std::string& filename);
+    // withVectors: 把归一化之后的词向量一起写进模型, 查询进程加载时直接映射;
+    // 还没有算过的话用 thread 个线程计算
+    void saveModel(const std::string& filename, bool withVectors = false, int32_t thread = 1);
 
     void saveOutput(const std::string& filename);
 
@@ -102,12 +168,44 @@ public:
             const std::string& word,
             int32_t k);
 
+    // 有索引时走 HNSW 近似搜索, ef 控制召回和延迟, 没有索引时退化为精确扫描
+    std::vector<std::pair<real, std::string>> getNN(
+            const std::string& word,
+            int32_t k,
+            int32_t ef);
+
+    // 批量精确查询, queries 的每一行是一个查询向量, 结果是 (余弦相似度, 词 id)
+    std::vector<Predictions> getNN(
+            const Matrix& queries,
+            int32_t k,
+            const std::vector<int32_t>& banIds,
+            int32_t thread);
+
+    // 整个词表的 top k 近邻, 每行: 词 近邻1 相似度1 近邻2 相似度2 ...
+    void saveNN(std::ostream& out, int32_t k, int32_t thread);
+
+    void buildIndex(int32_t M, int32_t efConstruction, int32_t thread);
+
+    void saveIndex(const std::string& filename);
+
+    void loadIndex(const std::string& filename);
+
 
     void train(const Args& args);
 
+    void encode(const Args& args);
+
+    // 对 input 做乘积量化, 之后 getWordVector/getNN 直接用编码, output 被丢弃
+    void quantize(const Args& qargs);
+
+    bool isQuant() const;
+
 
     int getDimension() const;
 
+    // 只算训练阶段, 不含读词典和初始化矩阵
+    double getTrainSeconds() const;
+
 
 };
 
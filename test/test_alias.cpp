@@ -10,9 +10,9 @@ int main() {
     std::vector<int32_t> a {1,4,3,2};
     std::vector<int32_t> freq {1,4,3,2};
     word2vec::AliasSample alias(freq, a);
+    word2vec::XorShiftRng rng(0);
 
     for (int i = 0; i < 100; ++i) {
-        std::cout << alias.Next() << std::endl;
+        std::cout << alias.Next(rng) << std::endl;
     }
 }
-